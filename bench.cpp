@@ -0,0 +1,760 @@
+#include "scene.hpp"
+#include "loader.hpp"
+#include "renderer.hpp"
+#include <cstdio>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <malloc.h>
+
+// Microbenchmarks of the hot paths.
+//
+//   raytracer_bench [--json] [--quick]
+//
+// Prints a table by default, with --json a single JSON document meant to be
+// stored and diffed against the numbers of another build.
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Result {
+    std::string name;
+    long size;
+    long ops;
+    double seconds;
+    std::string note;
+};
+
+std::vector<Result> results;
+double minTime = 0.2;
+FILE * table = stdout;
+volatile float sink;
+
+void report(const std::string & name, long size, long ops, double seconds, const std::string & note = "") {
+
+    Result result = { name, size, ops, seconds, note };
+    results.push_back(result);
+    fprintf(table, "%-22s %10ld %14.2f %14.3f %s\n", name.c_str(), size, seconds / ops * 1e9, ops / seconds / 1e6, note.c_str());
+}
+
+// Runs body(reps) with growing repetition counts until one run takes at
+// least minTime, then keeps the best of three such runs. body returns the
+// number of operations it performed.
+template <class Body> void run(const std::string & name, long size, Body body, const std::string & note = "") {
+
+    long reps = 1;
+    long ops = 0;
+    double seconds = 0.0;
+
+    while (true) {
+        Clock::time_point start = Clock::now();
+        ops = body(reps);
+        seconds = secondsSince(start);
+        if (seconds >= minTime)
+            break;
+        reps *= seconds > 0.0 ? std::max<long>(2, (long)(minTime / seconds)) : 16;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        Clock::time_point start = Clock::now();
+        body(reps);
+        seconds = std::min(seconds, secondsSince(start));
+    }
+
+    report(name, size, ops, seconds, note);
+}
+
+// Unit spheres scattered in a cube whose volume grows with the count, so
+// the density (and thus the work per ray near the hit) stays the same.
+// All surfaces reflect the given part of the light.
+World * randomSpheres(int count, std::mt19937 & rng, float mirror = 0.0f) {
+
+    float side = 4.0f * cbrt((float)count);
+    std::uniform_real_distribution<float> coord(-side / 2, side / 2);
+
+    World * world = new World();
+    for (int i = 0; i < count; i++) {
+        Vec3<float> origin(coord(rng), coord(rng), coord(rng));
+        Surface * surface = new Surface();
+        surface->setMirror(mirror);
+        world->addWorldObject(new WO_Sphere(surface, origin, 1.0f));
+    }
+    Surface * floor = new Surface();
+    floor->setMirror(mirror);
+    world->addWorldObject(new WO_Plane(floor, Vec3<float>(0.0f, -side, 0.0f), Vec3<float>(0.0f, 1.0f, 0.0f)));
+    world->addLight(new Light(Color(1.0f, 1.0f, 1.0f), Vec3<float>(side, side, -side)));
+
+    return world;
+}
+
+std::vector<Ray> randomRays(int count, float side, std::mt19937 & rng) {
+
+    std::uniform_real_distribution<float> coord(-side / 2, side / 2);
+    Vec3<float> origin(0.0f, 0.0f, -side);
+
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        Vec3<float> target(coord(rng), coord(rng), coord(rng));
+        rays.push_back(Ray(origin, target - origin));
+    }
+    return rays;
+}
+
+// Looks at the random sphere cube from outside, like randomRays.
+Camera * randomSpheresCamera(int count, int width, int height) {
+
+    float side = 4.0f * cbrt((float)count);
+    return new Cam_Std(width, height, Vec3<float>(0.0f, 0.0f, -side), 0.0f, 0.0f, 1.2f);
+}
+
+double renderFrame(const World * world, const Camera * camera, int width, int height) {
+
+    TileRenderer renderer(world, ThreadPool::hardwareThreads());
+
+    Clock::time_point start = Clock::now();
+    renderer.start(camera, width, height);
+    while (!renderer.finished())
+        delete renderer.next(100);
+    return secondsSince(start);
+}
+
+void primitives(std::mt19937 & rng) {
+
+    const int n = 1024;
+    std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+
+    std::vector<Vec3<float> > vectors;
+    std::vector<Ray> rays;
+    for (int i = 0; i < n; i++) {
+        vectors.push_back(Vec3<float>(coord(rng), coord(rng), coord(rng)));
+        rays.push_back(Ray(Vec3<float>(coord(rng), coord(rng), -20.0f), Vec3<float>(coord(rng), coord(rng), 20.0f)));
+    }
+
+    run("vec3_normalise", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++)
+                sum += vectors[i].normalise().getX();
+        sink = sum;
+        return reps * n;
+    });
+
+    Mat3<float> rotation = Mat3Identity<float>().rotateVer(0.25f).rotateHor(0.68f);
+    run("mat3_mul_vec3", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++)
+                sum += (rotation * vectors[i]).getX();
+        sink = sum;
+        return reps * n;
+    });
+
+    WO_Sphere sphere(new Surface(), Vec3<float>(0.0f, 0.0f, 0.0f), 5.0f);
+    run("sphere_distance", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++)
+                sum += sphere.distance(rays[i]);
+        sink = sum;
+        return reps * n;
+    });
+
+    WO_Plane plane(new Surface(), Vec3<float>(0.0f, 0.0f, 0.0f), Vec3<float>(0.2f, 0.3f, -1.0f).normalise());
+    run("plane_distance", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++)
+                sum += plane.distance(rays[i]);
+        sink = sum;
+        return reps * n;
+    });
+
+    // Spheres and planes in turn, once as objects on the heap called through
+    // their vtable, once compiled into a store.
+    std::vector<WorldObject*> objects;
+    PrimitiveStore store;
+    for (int i = 0; i < n; i++) {
+        if (i % 2)
+            objects.push_back(new WO_Sphere(new Surface(), vectors[i], 1.0f));
+        else
+            objects.push_back(new WO_Plane(new Surface(), vectors[i], vectors[n - 1 - i].normalise()));
+        objects.back()->compile(store);
+    }
+
+    run("object_distance", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++)
+                sum += objects[i]->distance(rays[(i + r) % n]);
+        sink = sum;
+        return reps * n;
+    });
+
+    run("store_distance", n, [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < n; i++) {
+                const Ray & ray = rays[(i + r) % n];
+                sum += store.distance(i, SimdRay(ray.origin, ray.direction));
+            }
+        sink = sum;
+        return reps * n;
+    });
+
+    for (int i = 0; i < n; i++)
+        delete objects[i];
+}
+
+void demoScene() {
+
+    const int size = 256;
+    Scene * scene = defaultScene(size, size);
+
+    std::vector<Ray> rays;
+    scene->camera->getRays(0, 0, size, size, 1, rays);
+
+    run("demo_cast_ray", rays.size(), [&](long reps) {
+        long hits = 0;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < rays.size(); i++)
+                hits += scene->world->castRay(rays[i]) >= 0;
+        sink = hits;
+        return reps * (long)rays.size();
+    });
+
+    run("demo_get_color", rays.size(), [&](long reps) {
+        float sum = 0.0f;
+        for (long r = 0; r < reps; r++)
+            for (int i = 0; i < rays.size(); i++)
+                sum += scene->world->getColor(rays[i]).r;
+        sink = sum;
+        return reps * (long)rays.size();
+    });
+
+    const int frame = 1024;
+    scene->camera->resize(frame, frame);
+    double best = renderFrame(scene->world.get(), scene->camera, frame, frame);
+    for (int i = 0; i < 2; i++)
+        best = std::min(best, renderFrame(scene->world.get(), scene->camera, frame, frame));
+    report("demo_frame", frame * frame, frame * frame, best);
+
+    // shading the frame again from its records, with and without tracing
+    // the shadow rays again
+    TileRenderer renderer(scene->world.get(), ThreadPool::hardwareThreads());
+    renderer.start(scene->camera, frame, frame);
+    while (!renderer.finished())
+        delete renderer.next(100);
+
+    for (int visibility = 0; visibility < 2; visibility++) {
+        double relit = std::numeric_limits<double>::infinity();
+        for (int i = 0; i < 3; i++) {
+            Clock::time_point start = Clock::now();
+            renderer.startRelit(scene->camera, frame, frame, visibility);
+            while (!renderer.finished())
+                delete renderer.next(100);
+            relit = std::min(relit, secondsSince(start));
+        }
+        report(visibility ? "demo_relight_shadows" : "demo_relight", frame * frame, frame * frame, relit);
+    }
+
+    delete scene;
+}
+
+void sphereScenes(std::mt19937 & rng, int maxCount) {
+
+    for (int count = 10; count <= maxCount; count *= 10) {
+
+        World * world = randomSpheres(count, rng);
+        std::vector<Ray> rays = randomRays(10000, 4.0f * cbrt((float)count), rng);
+
+        Clock::time_point start = Clock::now();
+        world->build();
+        report("build", count, count, secondsSince(start));
+
+        run("cast_ray", count, [&](long reps) {
+            long hits = 0;
+            for (long r = 0; r < reps; r++)
+                for (int i = 0; i < rays.size(); i++)
+                    hits += world->castRay(rays[i]) >= 0;
+            sink = hits;
+            return reps * (long)rays.size();
+        });
+
+        if (count <= 10000) {
+            std::vector<Ray> few(rays.begin(), rays.begin() + std::min<int>(rays.size(), 1000000 / count));
+            run("cast_ray_linear", count, [&](long reps) {
+                long hits = 0;
+                for (long r = 0; r < reps; r++)
+                    for (int i = 0; i < few.size(); i++)
+                        hits += world->castRayLinear(few[i]) >= 0;
+                sink = hits;
+                return reps * (long)few.size();
+            });
+        }
+
+        run("get_color", count, [&](long reps) {
+            float sum = 0.0f;
+            for (long r = 0; r < reps; r++)
+                for (int i = 0; i < rays.size(); i++)
+                    sum += world->getColor(rays[i]).r;
+            sink = sum;
+            return reps * (long)rays.size();
+        });
+
+        const int frame = 512;
+        Camera * camera = randomSpheresCamera(count, frame, frame);
+        report("frame", count, frame * frame, renderFrame(world, camera, frame, frame));
+        delete camera;
+
+        delete world;
+    }
+}
+
+// Recursive and wavefront shading of scenes where most rays bounce a few
+// times. Both have to give the very same colors.
+void shadingModes(std::mt19937 & rng) {
+
+    const int count = 1000;
+    const int frame = 512;
+
+    World * world = randomSpheres(count, rng, 0.8f);
+    world->build();
+    Camera * camera = randomSpheresCamera(count, frame, frame);
+
+    std::vector<Ray> rays;
+    camera->getRays(0, 0, frame, frame, 1, rays);
+    std::vector<Color> reference(rays.size());
+    std::vector<Color> colors(rays.size());
+
+    world->setShadingMode(SHADE_RECURSIVE);
+    world->getColors(&rays[0], rays.size(), &reference[0]);
+    world->setShadingMode(SHADE_WAVEFRONT);
+    world->getColors(&rays[0], rays.size(), &colors[0]);
+    bool identical = memcmp(&reference[0], &colors[0], colors.size() * sizeof(Color)) == 0;
+
+    const char * names[] = { "mirror_frame_recursive", "mirror_frame_wavefront" };
+    for (int mode = SHADE_RECURSIVE; mode <= SHADE_WAVEFRONT; mode++) {
+
+        world->setShadingMode((ShadingMode)mode);
+        double best = renderFrame(world, camera, frame, frame);
+        for (int i = 0; i < 2; i++)
+            best = std::min(best, renderFrame(world, camera, frame, frame));
+        report(names[mode], count, frame * frame, best, mode == SHADE_WAVEFRONT ? (identical ? "identical" : "MISMATCH") : "");
+    }
+
+    // leaving out reflections of low throughput, rays saved against the
+    // error compared to following all of them
+    world->setTermination(0.0f, false);
+    RenderStats before = RenderStats::snapshot();
+    world->getColors(&rays[0], rays.size(), &reference[0]);
+    unsigned long fullRays = (RenderStats::snapshot() - before).rays();
+
+    const float thresholds[] = { 0.3f, 0.1f };
+    for (int t = 0; t < 2; t++) {
+        for (int roulette = 0; roulette < 2; roulette++) {
+
+            world->setTermination(thresholds[t], roulette);
+            before = RenderStats::snapshot();
+            world->getColors(&rays[0], rays.size(), &colors[0]);
+            unsigned long tracedRays = (RenderStats::snapshot() - before).rays();
+
+            double maxError = 0.0;
+            for (int i = 0; i < colors.size(); i++) {
+                maxError = std::max(maxError, (double)fabs(colors[i].r - reference[i].r));
+                maxError = std::max(maxError, (double)fabs(colors[i].g - reference[i].g));
+                maxError = std::max(maxError, (double)fabs(colors[i].b - reference[i].b));
+            }
+
+            char note[96];
+            snprintf(note, sizeof(note), "min throughput %g, %.1f%% fewer rays, max error %.4f", 
+                thresholds[t], 100.0 * (1.0 - (double)tracedRays / fullRays), maxError);
+
+            double best = renderFrame(world, camera, frame, frame);
+            for (int i = 0; i < 2; i++)
+                best = std::min(best, renderFrame(world, camera, frame, frame));
+            report(roulette ? "mirror_frame_roulette" : "mirror_frame_terminated", count, frame * frame, best, note);
+        }
+    }
+
+    delete camera;
+    delete world;
+}
+
+// Loading scene files of random spheres, parsing and building the world.
+void sceneFiles(std::mt19937 & rng, int maxCount) {
+
+    const char * path = "raytracer_bench.scene";
+    const char * snapshotPath = "raytracer_bench.snapshot";
+
+    for (int count = 10000; count <= maxCount; count *= 10) {
+
+        float side = 4.0f * cbrt((float)count);
+        std::uniform_real_distribution<float> coord(-side / 2, side / 2);
+
+        FILE * file = fopen(path, "w");
+        if (!file)
+            return;
+        fprintf(file, "light 1 1 1 %g %g %g\nsurface red color 1 0 0\nsurface blue color 0 0 1 mirror 0.3\n", side, side, -side);
+        for (int i = 0; i < count; i++)
+            fprintf(file, "sphere %s %.4f %.4f %.4f 1\n", i % 2 ? "red" : "blue", coord(rng), coord(rng), coord(rng));
+        long bytes = ftell(file);
+        fclose(file);
+
+        Clock::time_point start = Clock::now();
+        Scene * scene = loadScene(path, 256, 256);
+        double seconds = secondsSince(start);
+
+        char note[64];
+        snprintf(note, sizeof(note), "%.1f MB", bytes / 1e6);
+        report("load_scene", count, count, seconds, note);
+
+        std::string error;
+        SnapshotWriter().write(snapshotPath, scene, error);
+        delete scene;
+
+        start = Clock::now();
+        scene = loadScene(snapshotPath, 256, 256);
+        seconds = secondsSince(start);
+        report("load_snapshot", count, count, seconds);
+        delete scene;
+    }
+    remove(path);
+    remove(snapshotPath);
+}
+
+// A bumpy square terrain of about count triangles as OBJ file: loading it
+// (triangles per second, bytes per triangle) and casting rays at it.
+void meshFiles(std::mt19937 & rng, int maxCount) {
+
+    const char * path = "raytracer_bench.obj";
+
+    for (int count = 10000; count <= maxCount; count *= 10) {
+
+        int side = (int)sqrt(count / 2.0);
+        std::uniform_real_distribution<float> bump(0.0f, 0.3f);
+
+        FILE * file = fopen(path, "w");
+        if (!file)
+            return;
+        for (int z = 0; z <= side; z++)
+            for (int x = 0; x <= side; x++)
+                fprintf(file, "v %d %.4f %d\n", x - side / 2, bump(rng), z - side / 2);
+        for (int z = 0; z < side; z++) {
+            for (int x = 0; x < side; x++) {
+                int corner = z * (side + 1) + x + 1;
+                fprintf(file, "f %d %d %d %d\n", corner, corner + side + 1, corner + side + 2, corner + 1);
+            }
+        }
+        long bytes = ftell(file);
+        fclose(file);
+
+        ObjLoader loader;
+        Clock::time_point start = Clock::now();
+        std::shared_ptr<const TriangleMesh> mesh = loader.load(path);
+        double seconds = secondsSince(start);
+        if (!mesh)
+            return;
+
+        int triangles = mesh->triangleCount();
+        char note[64];
+        snprintf(note, sizeof(note), "%.1f MB, %.1f B/triangle", bytes / 1e6, (double)mesh->memory() / triangles);
+        report("load_obj", triangles, triangles, seconds, note);
+
+        World world;
+        world.addMesh(world.addSurface(new Surface()), mesh);
+        world.build();
+
+        std::uniform_real_distribution<float> coord(-side / 2.0f, side / 2.0f);
+        Vec3<float> origin(0.0f, (float)side, -(float)side);
+        std::vector<Ray> rays;
+        for (int i = 0; i < 10000; i++)
+            rays.push_back(Ray(origin, Vec3<float>(coord(rng), 0.0f, coord(rng)) - origin));
+
+        run("cast_ray_mesh", triangles, [&](long reps) {
+            long hits = 0;
+            for (long r = 0; r < reps; r++)
+                for (int i = 0; i < rays.size(); i++)
+                    hits += world.castRay(rays[i]) >= 0;
+            sink = hits;
+            return reps * (long)rays.size();
+        });
+    }
+    remove(path);
+}
+
+// Bytes allocated on the heap, 0 where the C library does not tell.
+long heapBytes() {
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// A unit sphere of rings x segments quads.
+std::shared_ptr<const TriangleMesh> sphereMesh(int rings, int segments) {
+
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    for (int j = 0; j <= rings; j++) {
+        for (int i = 0; i <= segments; i++) {
+            float theta = (float)M_PI * j / rings;
+            float phi = 2.0f * (float)M_PI * i / segments;
+            vertices.push_back(sin(theta) * cos(phi));
+            vertices.push_back(cos(theta));
+            vertices.push_back(sin(theta) * sin(phi));
+        }
+    }
+    for (int j = 0; j < rings; j++) {
+        for (int i = 0; i < segments; i++) {
+            int a = j * (segments + 1) + i;
+            int b = a + segments + 1;
+            int quad[6] = { a, a + 1, b + 1, a, b + 1, b };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return std::make_shared<TriangleMesh>(vertices, indices);
+}
+
+// Instances of three sphere meshes scattered like randomSpheres, each
+// turned and stretched: the memory one takes and casting rays at them.
+void instances(std::mt19937 & rng, int maxCount) {
+
+    std::shared_ptr<const TriangleMesh> prototypes[3] = { sphereMesh(8, 8), sphereMesh(16, 16), sphereMesh(32, 32) };
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (int count = 10000; count <= maxCount; count *= 10) {
+
+        float side = 4.0f * cbrt((float)count);
+        std::uniform_real_distribution<float> coord(-side / 2, side / 2);
+
+        long before = heapBytes();
+        World * world = new World();
+        Surface * surface = world->addSurface(new Surface());
+        for (int i = 0; i < count; i++) {
+            Transform<float> transform = Transform<float>::translate(Vec3<float>(coord(rng), coord(rng), coord(rng)))
+                * Transform<float>::rotateY(6.28f * unit(rng)) * Transform<float>::rotateX(6.28f * unit(rng))
+                * Transform<float>::scale(0.5f + unit(rng), 0.5f + unit(rng), 0.5f + unit(rng));
+            world->addInstance(surface, prototypes[i % 3], transform);
+        }
+        world->build();
+        long bytes = heapBytes() - before;
+
+        char note[64];
+        snprintf(note, sizeof(note), "%.0f B/instance", (double)bytes / count);
+
+        std::vector<Ray> rays = randomRays(10000, side, rng);
+        run("cast_ray_instances", count, [&](long reps) {
+            long hits = 0;
+            for (long r = 0; r < reps; r++)
+                for (int i = 0; i < rays.size(); i++)
+                    hits += world->castRay(rays[i]) >= 0;
+            sink = hits;
+            return reps * (long)rays.size();
+        }, note);
+        delete world;
+    }
+}
+
+// Spheres drifting through the scene, a share of them moved each frame: the
+// update has to cost per moved sphere about the same in a large scene as in
+// a small one, and far less than a build.
+void animation(std::mt19937 & rng, int maxCount) {
+
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    for (int count = 10000; count <= maxCount; count *= 10) {
+
+        World * world = randomSpheres(count, rng);
+        float side = 4.0f * cbrt((float)count);
+
+        Clock::time_point start = Clock::now();
+        world->build();
+        double buildSeconds = secondsSince(start);
+
+        for (int moved = 100; moved <= count / 10; moved *= 10) {
+
+            // the spheres are objects 0 to count - 1
+            std::vector<int> ids(moved);
+            std::vector<Vec3<float> > centers(moved), velocities(moved);
+            for (int i = 0; i < moved; i++) {
+                ids[i] = std::uniform_int_distribution<int>(0, count - 1)(rng);
+                centers[i] = world->bounds(ids[i]).centroid();
+                velocities[i] = Vec3<float>(unit(rng), unit(rng), unit(rng)) * 0.05f;
+            }
+
+            long frames = 0;
+            long rebuilds = 0;
+            double seconds = 0.0;
+            while (seconds < minTime) {
+
+                for (int i = 0; i < moved; i++) {
+                    centers[i] = centers[i] + velocities[i];
+                    if (fabs(centers[i].getX()) > side / 2 || fabs(centers[i].getY()) > side / 2 || fabs(centers[i].getZ()) > side / 2)
+                        velocities[i] = velocities[i] * -1.0f;
+                }
+
+                Clock::time_point start = Clock::now();
+                for (int i = 0; i < moved; i++)
+                    world->moveSphere(ids[i], centers[i], 1.0f);
+                double before = world->getDegradation();
+                world->update();
+                seconds += secondsSince(start);
+
+                rebuilds += before > 1.0 && world->getDegradation() == 1.0;
+                frames++;
+            }
+
+            char note[96];
+            snprintf(note, sizeof(note), "%d moved, %.2f%% of a build, %ld rebuilds in %ld frames",
+                moved, seconds / frames / buildSeconds * 100.0, rebuilds, frames);
+            report("update_moved", count, frames * moved, seconds, note);
+        }
+        delete world;
+    }
+}
+
+// Publishing a version with 100 spheres moved while a frame holds the one
+// before: the clone shares every table, the edit copies those it touches.
+void versions(std::mt19937 & rng, int maxCount) {
+
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    for (int count = 10000; count <= maxCount; count *= 10) {
+
+        World * world = randomSpheres(count, rng);
+        Clock::time_point start = Clock::now();
+        world->build();
+        double buildSeconds = secondsSince(start);
+
+        std::shared_ptr<const World> first(world);
+        WorldVersions worlds(first);
+        first.reset();
+        std::vector<int> ids(100);
+        for (int i = 0; i < ids.size(); i++)
+            ids[i] = std::uniform_int_distribution<int>(0, count - 1)(rng);
+
+        long edits = 0;
+        double seconds = 0.0;
+        while (seconds < minTime) {
+
+            std::shared_ptr<const World> frame = worlds.pin();
+            start = Clock::now();
+            worlds.edit([&](World & next) {
+                for (int i = 0; i < ids.size(); i++) {
+                    Vec3<float> center = next.bounds(ids[i]).centroid();
+                    next.moveSphere(ids[i], center + Vec3<float>(unit(rng), unit(rng), unit(rng)) * 0.05f, 1.0f);
+                }
+            });
+            seconds += secondsSince(start);
+            edits++;
+        }
+
+        char note[64];
+        snprintf(note, sizeof(note), "100 moved, %.2f%% of a build", seconds / edits / buildSeconds * 100.0);
+        report("publish_version", count, edits, seconds, note);
+    }
+}
+
+// Every kernel level has to report the very same hits as the scalar one.
+void simdLevels(std::mt19937 & rng, int count) {
+
+    World * world = randomSpheres(count, rng);
+    std::vector<Ray> rays = randomRays(100000, 4.0f * cbrt((float)count), rng);
+    world->build();
+
+    std::vector<Hit> reference(rays.size());
+
+    for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+
+        setSimdLevel((SimdLevel)level);
+
+        Clock::time_point start = Clock::now();
+        long hits = 0;
+        for (int i = 0; i < rays.size(); i++)
+            hits += world->castRay(rays[i]) >= 0;
+        double seconds = secondsSince(start);
+        sink = hits;
+
+        bool identical = true;
+        for (int i = 0; i < rays.size(); i++) {
+            Hit hit;
+            world->castRay(rays[i], hit);
+            if (level == SIMD_SCALAR)
+                reference[i] = hit;
+            else if (hit.object != reference[i].object || memcmp(&hit.t, &reference[i].t, sizeof(float)) != 0)
+                identical = false;
+        }
+
+        report(std::string("cast_ray_") + simdLevelName((SimdLevel)level), count, rays.size(), seconds,
+            identical ? "identical" : "MISMATCH");
+    }
+    setSimdLevel(detectSimdLevel());
+    delete world;
+}
+
+void writeJSON() {
+
+    printf("{\n");
+    printf("  \"simd\": \"%s\",\n", simdLevelName(simdLevel()));
+    printf("  \"threads\": %d,\n", ThreadPool::hardwareThreads());
+    printf("  \"benchmarks\": [\n");
+    for (int i = 0; i < results.size(); i++) {
+        const Result & r = results[i];
+        printf("    {\"name\": \"%s\", \"size\": %ld, \"ops\": %ld, \"seconds\": %.6g, \"ns_per_op\": %.6g, \"ops_per_sec\": %.6g",
+            r.name.c_str(), r.size, r.ops, r.seconds, r.seconds / r.ops * 1e9, r.ops / r.seconds);
+        if (!r.note.empty())
+            printf(", \"note\": \"%s\"", r.note.c_str());
+        printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+
+    bool json = false;
+    int maxCount = 1000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--quick") == 0) {
+            minTime = 0.02;
+            maxCount = 10000;
+        }
+        else {
+            fprintf(stderr, "usage: %s [--json] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // with --json the table goes to stderr so stdout stays valid JSON
+    if (json)
+        table = stderr;
+
+    fprintf(table, "%-22s %10s %14s %14s\n", "benchmark", "size", "ns/op", "Mop/s");
+
+    std::mt19937 rng(1234);
+    primitives(rng);
+    demoScene();
+    sphereScenes(rng, maxCount);
+    shadingModes(rng);
+    simdLevels(rng, maxCount / 10);
+    sceneFiles(rng, maxCount);
+    meshFiles(rng, maxCount);
+    instances(rng, maxCount);
+    animation(rng, maxCount);
+    versions(rng, maxCount);
+
+    if (json)
+        writeJSON();
+    return 0;
+}
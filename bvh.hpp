@@ -0,0 +1,685 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "vec3.hpp"
+#include "simd.hpp"
+#include "table.hpp"
+
+inline float axisOf(const Vec3<float> & v, int axis) {
+
+	return axis == 0 ? v.getX() : (axis == 1 ? v.getY() : v.getZ());
+}
+
+class AABB
+{
+public:
+	Vec3<float> lower;
+	Vec3<float> upper;
+
+	AABB() {
+		float inf = std::numeric_limits<float>::infinity();
+		lower = Vec3<float>(inf, inf, inf);
+		upper = Vec3<float>(-inf, -inf, -inf);
+	}
+	AABB(const Vec3<float> & _lower, const Vec3<float> & _upper)
+	: lower(_lower), upper(_upper) {
+
+	}
+
+	bool empty() const { return lower.getX() > upper.getX(); }
+
+	void extend(const Vec3<float> & point) {
+		lower = Vec3<float>(
+			std::min(lower.getX(), point.getX()),
+			std::min(lower.getY(), point.getY()),
+			std::min(lower.getZ(), point.getZ()));
+		upper = Vec3<float>(
+			std::max(upper.getX(), point.getX()),
+			std::max(upper.getY(), point.getY()),
+			std::max(upper.getZ(), point.getZ()));
+	}
+	void extend(const AABB & box) {
+		if (box.empty())
+			return;
+		extend(box.lower);
+		extend(box.upper);
+	}
+
+	Vec3<float> centroid() const {
+		return (lower + upper) * 0.5f;
+	}
+	float area() const {
+		if (empty())
+			return 0.0f;
+		Vec3<float> d = upper - lower;
+		return 2.0f * (d.getX() * d.getY() + d.getY() * d.getZ() + d.getZ() * d.getX());
+	}
+};
+
+// Flat node layout: interior nodes keep their two children next to each other
+// starting at 'start', leaves reference 'count' primitives starting at 'start'
+// in BVH::indices.
+struct BVHNode
+{
+	float lower[3];
+	float upper[3];
+	int start;
+	int count;
+
+	bool leaf() const { return count > 0; }
+};
+
+// Ray data prepared once per traversal.
+struct BVHRay
+{
+	float origin[3];
+	float invDir[3];
+
+	BVHRay() {}
+	BVHRay(const Vec3<float> & _origin, const Vec3<float> & direction) {
+		origin[0] = _origin.getX();
+		origin[1] = _origin.getY();
+		origin[2] = _origin.getZ();
+		invDir[0] = 1.0f / direction.getX();
+		invDir[1] = 1.0f / direction.getY();
+		invDir[2] = 1.0f / direction.getZ();
+	}
+
+	// Slab test, on a hit tNear receives the entry distance. The exit is
+	// widened by the rounding error of the test (Ize, Robust BVH Ray
+	// Traversal), so a ray through an edge or corner of a box still enters
+	// it, as the triangles of a mesh need.
+	bool enter(const BVHNode & node, float tMax, float & tNear) const {
+
+		float tFar = tMax;
+		tNear = 0.0f;
+		for (int a = 0; a < 3; a++) {
+			float t0 = (node.lower[a] - origin[a]) * invDir[a];
+			float t1 = (node.upper[a] - origin[a]) * invDir[a];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+
+		return tNear <= tFar * (1.0f + 3 * std::numeric_limits<float>::epsilon());
+	}
+};
+
+// Up to 16 rays (a 4x4 pixel block, or the shadow rays toward one light)
+// traversed together, stored as structure of arrays so a node can be tested
+// against all of them with a few vector instructions. Lanes are addressed
+// through bit masks.
+struct BVHPacket
+{
+	enum { capacity = 16 };
+
+	int count;
+	float origin[3][capacity];
+	float invDir[3][capacity];
+	float tMax[capacity];
+
+	// Interval bounds of the origins and inverse directions, an axis only
+	// takes part in the interval test if all directions agree in sign on it.
+	float originLo[3];
+	float originHi[3];
+	float invLo[3];
+	float invHi[3];
+	bool axisValid[3];
+
+	BVHPacket() : count(0) {
+
+		for (int a = 0; a < 3; a++) {
+			std::fill(origin[a], origin[a] + capacity, 0.0f);
+			std::fill(invDir[a], invDir[a] + capacity, 0.0f);
+		}
+		std::fill(tMax, tMax + capacity, -1.0f);
+	}
+
+	unsigned all() const { return (1u << count) - 1; }
+
+	void add(const Vec3<float> & _origin, const Vec3<float> & direction, float _tMax) {
+		BVHRay ray(_origin, direction);
+		for (int a = 0; a < 3; a++) {
+			origin[a][count] = ray.origin[a];
+			invDir[a][count] = ray.invDir[a];
+		}
+		tMax[count] = _tMax;
+		count++;
+	}
+
+	// Computes the interval bounds over the lanes in mask.
+	void finish(unsigned mask) {
+
+		float inf = std::numeric_limits<float>::infinity();
+		for (int a = 0; a < 3; a++) {
+
+			originLo[a] = invLo[a] = inf;
+			originHi[a] = invHi[a] = -inf;
+			for (int i = 0; i < count; i++) {
+				if (!((mask >> i) & 1))
+					continue;
+				originLo[a] = std::min(originLo[a], origin[a][i]);
+				originHi[a] = std::max(originHi[a], origin[a][i]);
+				invLo[a] = std::min(invLo[a], invDir[a][i]);
+				invHi[a] = std::max(invHi[a], invDir[a][i]);
+			}
+
+			axisValid[a] = mask != 0 
+				&& (invLo[a] > 0.0f || invHi[a] < 0.0f) 
+				&& invLo[a] > -inf && invHi[a] < inf;
+		}
+	}
+
+	// Lanes of mask whose ray hits the node before its tMax.
+	unsigned hits(const BVHNode & node, unsigned mask) const {
+
+		return boxLanes(origin, invDir, tMax, node.lower, node.upper) & mask;
+	}
+
+	// Entry distance of one lane into the node.
+	float entry(int lane, const BVHNode & node) const {
+
+		float tNear = 0.0f;
+		for (int a = 0; a < 3; a++) {
+			float t0 = (node.lower[a] - origin[a][lane]) * invDir[a][lane];
+			float t1 = (node.upper[a] - origin[a][lane]) * invDir[a][lane];
+			tNear = std::max(tNear, std::min(t0, t1));
+		}
+		return tNear;
+	}
+
+	// Conservative test: true only if no ray of the packet can hit the node
+	// before tMaxHi.
+	bool missesAll(const BVHNode & node, float tMaxHi) const {
+
+		float tNear = 0.0f;
+		float tFar = tMaxHi;
+		for (int a = 0; a < 3; a++) {
+
+			if (!axisValid[a])
+				continue;
+
+			bool positive = invLo[a] > 0.0f;
+			float enterPlane = positive ? node.lower[a] : node.upper[a];
+			float exitPlane = positive ? node.upper[a] : node.lower[a];
+
+			tNear = std::max(tNear, intervalLo(enterPlane, a));
+			tFar = std::min(tFar, intervalHi(exitPlane, a));
+		}
+		return tNear > tFar;
+	}
+
+	// Bounds of (plane - origin) * invDir over the whole packet.
+	float intervalLo(float plane, int a) const {
+		float d0 = plane - originHi[a];
+		float d1 = plane - originLo[a];
+		return std::min(std::min(d0 * invLo[a], d0 * invHi[a]), std::min(d1 * invLo[a], d1 * invHi[a]));
+	}
+	float intervalHi(float plane, int a) const {
+		float d0 = plane - originHi[a];
+		float d1 = plane - originLo[a];
+		return std::max(std::max(d0 * invLo[a], d0 * invHi[a]), std::max(d1 * invLo[a], d1 * invHi[a]));
+	}
+
+	float maxDistance(unsigned mask) const {
+		float t = 0.0f;
+		for (int i = 0; i < count; i++)
+			if ((mask >> i) & 1)
+				t = std::max(t, tMax[i]);
+		return t;
+	}
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+// It only knows about boxes and primitive ids, intersecting the primitives
+// of a leaf is left to the caller.
+class BVH
+{
+private:
+	static const int binCount = 16;
+	static const int stackSize = 64;
+
+	int maxLeafSize;
+	int leafWidth;
+
+	std::vector<AABB> boxes;
+	std::vector<Vec3<float> > centers;
+
+	struct Bin
+	{
+		AABB box;
+		int count;
+
+		Bin() : count(0) {}
+	};
+
+	void setBounds(BVHNode & node, const AABB & box) {
+
+		node.lower[0] = box.lower.getX();
+		node.lower[1] = box.lower.getY();
+		node.lower[2] = box.lower.getZ();
+		node.upper[0] = box.upper.getX();
+		node.upper[1] = box.upper.getY();
+		node.upper[2] = box.upper.getZ();
+	}
+
+	int binOf(const Vec3<float> & center, int axis, float lo, float scale) const {
+
+		int bin = (int)((axisOf(center, axis) - lo) * scale);
+		return std::max(0, std::min(binCount - 1, bin));
+	}
+
+	void build(int nodeIndex, int begin, int end, int depth) {
+
+		AABB bounds;
+		AABB centroidBounds;
+		for (int i = begin; i < end; i++) {
+			bounds.extend(boxes[order[i]]);
+			centroidBounds.extend(centers[order[i]]);
+		}
+
+		setBounds(nodes[nodeIndex], bounds);
+		nodes[nodeIndex].start = begin;
+		nodes[nodeIndex].count = end - begin;
+
+		int n = end - begin;
+		if (n <= 1 || depth >= stackSize - 2)
+			return;
+
+		Vec3<float> extent = centroidBounds.upper - centroidBounds.lower;
+		int axis = 0;
+		if (extent.getY() > axisOf(extent, axis))
+			axis = 1;
+		if (extent.getZ() > axisOf(extent, axis))
+			axis = 2;
+
+		int mid;
+		float lo = axisOf(centroidBounds.lower, axis);
+		float width = axisOf(extent, axis);
+
+		if (width <= 0.0f) {
+			if (n <= maxLeafSize)
+				return;
+			mid = begin + n / 2;
+		}
+		else {
+			float scale = binCount / width;
+
+			Bin bins[binCount];
+			for (int i = begin; i < end; i++) {
+				Bin & bin = bins[binOf(centers[order[i]], axis, lo, scale)];
+				bin.box.extend(boxes[order[i]]);
+				bin.count++;
+			}
+
+			float rightArea[binCount];
+			int rightCount[binCount];
+			AABB acc;
+			int count = 0;
+			for (int i = binCount - 1; i > 0; i--) {
+				acc.extend(bins[i].box);
+				count += bins[i].count;
+				rightArea[i] = acc.area();
+				rightCount[i] = count;
+			}
+
+			float bestCost = std::numeric_limits<float>::infinity();
+			int bestSplit = -1;
+			acc = AABB();
+			count = 0;
+			for (int i = 0; i < binCount - 1; i++) {
+				acc.extend(bins[i].box);
+				count += bins[i].count;
+				if (count == 0 || rightCount[i + 1] == 0)
+					continue;
+
+				float cost = acc.area() * ((count + leafWidth - 1) / leafWidth) 
+					+ rightArea[i + 1] * ((rightCount[i + 1] + leafWidth - 1) / leafWidth);
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestSplit = i;
+				}
+			}
+
+			// a traversal step is weighted like one test of leafWidth primitives
+			float leafCost = bounds.area() * ((n + leafWidth - 1) / leafWidth);
+			bestCost += bounds.area();
+			if (n <= maxLeafSize && (bestSplit == -1 || leafCost <= bestCost))
+				return;
+
+			if (bestSplit == -1) {
+				mid = begin + n / 2;
+			}
+			else {
+				mid = std::partition(order.begin() + begin, order.begin() + end,
+					SplitPredicate(this, axis, lo, scale, bestSplit)) - order.begin();
+				if (mid == begin || mid == end)
+					mid = begin + n / 2;
+			}
+		}
+
+		int left = nodes.size();
+		nodes[nodeIndex].start = left;
+		nodes[nodeIndex].count = 0;
+		nodes.push_back(BVHNode());
+		nodes.push_back(BVHNode());
+
+		build(left, begin, mid, depth + 1);
+		build(left + 1, mid, end, depth + 1);
+	}
+
+	struct SplitPredicate
+	{
+		const BVH * bvh;
+		int axis;
+		float lo;
+		float scale;
+		int split;
+
+		SplitPredicate(const BVH * _bvh, int _axis, float _lo, float _scale, int _split)
+		: bvh(_bvh), axis(_axis), lo(_lo), scale(_scale), split(_split) {}
+
+		bool operator()(int ref) const {
+			return bvh->binOf(bvh->centers[ref], axis, lo, scale) <= split;
+		}
+	};
+
+	std::vector<int> order;
+
+	// For refits, made on the first one after building: the parent of each
+	// node and the leaf of each entry of indices.
+	Table<int> parents;
+	Table<int> leafOf;
+
+	// Surface area of all nodes together, and that over the area of the
+	// root before the first refit: the cost of the hierarchy by the surface
+	// area heuristic, short of the leaves, which refits do not change.
+	double areaSum;
+	double builtCost;
+
+	static float area(const BVHNode & node) {
+		return boundsOf(node).area();
+	}
+
+	static bool same(const Vec3<float> & a, const Vec3<float> & b) {
+		return a.getX() == b.getX() && a.getY() == b.getY() && a.getZ() == b.getZ();
+	}
+
+	static AABB boundsOf(const BVHNode & node) {
+		return AABB(Vec3<float>(node.lower[0], node.lower[1], node.lower[2]),
+			Vec3<float>(node.upper[0], node.upper[1], node.upper[2]));
+	}
+
+	double cost() const {
+		float rootArea = nodes.empty() ? 0.0f : area(nodes[0]);
+		return rootArea > 0.0f ? areaSum / rootArea : 1.0;
+	}
+
+	void link() {
+
+		const Table<BVHNode> & tree = nodes;
+		parents.assign(tree.size(), -1);
+		leafOf.assign(indices.size(), -1);
+		for (int i = 0; i < tree.size(); i++) {
+			if (tree[i].leaf()) {
+				for (int k = tree[i].start; k < tree[i].start + tree[i].count; k++)
+					leafOf[k] = i;
+			}
+			else {
+				parents[tree[i].start] = i;
+				parents[tree[i].start + 1] = i;
+			}
+		}
+
+		areaSum = 0.0;
+		for (int i = 0; i < tree.size(); i++)
+			areaSum += area(tree[i]);
+		builtCost = cost();
+	}
+
+public:
+	Table<BVHNode> nodes;
+	Table<int> indices;
+
+	// Primitives are assumed to be tested leafWidth at a time.
+	BVH(int _maxLeafSize = 4, int _leafWidth = 1) : maxLeafSize(_maxLeafSize), leafWidth(_leafWidth), areaSum(0.0), builtCost(1.0) {}
+
+	// Takes effect with the next build.
+	void setLeaves(int _maxLeafSize, int _leafWidth) {
+		maxLeafSize = _maxLeafSize;
+		leafWidth = _leafWidth;
+	}
+
+	bool empty() const { return nodes.empty(); }
+	void clear() {
+		nodes.clear();
+		indices.clear();
+		parents.clear();
+		leafOf.clear();
+		areaSum = 0.0;
+		builtCost = 1.0;
+	}
+
+	template <class Visitor> void visitTables(Visitor & visit) {
+		visit(nodes);
+		visit(indices);
+	}
+
+	// Whether the tables, e.g. read from a file, can be traversed: children
+	// come after their parent, leaves lie within indices, no path is deeper
+	// than the traversal stack and every index is below idCount.
+	bool valid(int idCount) const {
+
+		std::vector<int> depth(nodes.size(), 0);
+		for (size_t i = 0; i < nodes.size(); i++) {
+			const BVHNode & node = nodes[i];
+			if (node.leaf()) {
+				if (node.start < 0 || (size_t)node.start + node.count > indices.size())
+					return false;
+			}
+			else {
+				if (node.start <= (long)i || (size_t)node.start + 1 >= nodes.size() || depth[i] >= stackSize - 2)
+					return false;
+				depth[node.start] = std::max(depth[node.start], depth[i] + 1);
+				depth[node.start + 1] = std::max(depth[node.start + 1], depth[i] + 1);
+			}
+		}
+		for (size_t i = 0; i < indices.size(); i++)
+			if (indices[i] < 0 || indices[i] >= idCount)
+				return false;
+		return true;
+	}
+
+	// Builds the hierarchy over boxes[i], tagging each with ids[i].
+	void build(const std::vector<AABB> & _boxes, const std::vector<int> & ids) {
+
+		clear();
+		if (_boxes.empty())
+			return;
+
+		boxes = _boxes;
+		centers.resize(boxes.size());
+		order.resize(boxes.size());
+		for (int i = 0; i < boxes.size(); i++) {
+			centers[i] = boxes[i].centroid();
+			order[i] = i;
+		}
+
+		nodes.reserve(2 * boxes.size());
+		nodes.push_back(BVHNode());
+		build(0, 0, boxes.size(), 0);
+
+		indices.resize(order.size());
+		for (int i = 0; i < order.size(); i++)
+			indices[i] = ids[order[i]];
+
+		std::vector<AABB>().swap(boxes);
+		std::vector<Vec3<float> >().swap(centers);
+		std::vector<int>().swap(order);
+	}
+
+	// Fits the boxes from the leaf holding indices[slot] up to the root to
+	// bounds(id) of the leaf entries, after one of them moved. Stops at the
+	// first box that stays the same, so it costs at most the depth of the
+	// leaf.
+	template <class Bounds> void refit(int slot, const Bounds & bounds) {
+
+		if (parents.empty())
+			link();
+
+		const Table<int> & ids = indices;
+		const Table<int> & up = parents;
+		int n = static_cast<const Table<int>&>(leafOf)[slot];
+		const BVHNode & leaf = static_cast<const Table<BVHNode>&>(nodes)[n];
+		AABB box;
+		for (int k = leaf.start; k < leaf.start + leaf.count; k++)
+			box.extend(bounds(ids[k]));
+
+		while (n != -1) {
+
+			BVHNode & node = nodes[n];
+			AABB old = boundsOf(node);
+			if (same(old.lower, box.lower) && same(old.upper, box.upper))
+				break;
+
+			areaSum += box.area() - old.area();
+			setBounds(node, box);
+
+			n = up[n];
+			if (n != -1) {
+				const BVHNode & parent = nodes[n];
+				box = boundsOf(nodes[parent.start]);
+				box.extend(boundsOf(nodes[parent.start + 1]));
+			}
+		}
+	}
+
+	// How many times worse for tracing refits have made the hierarchy than
+	// it was when built, by the surface area heuristic.
+	double degradation() const { return parents.empty() ? 1.0 : cost() / builtCost; }
+
+	// Traverses all lanes in mask together. A node is skipped when the
+	// interval test rules it out for the whole packet, otherwise the lanes
+	// that miss it are masked off for the subtree. visit(start, count, lanes)
+	// tests the leaf for the given lanes, updates packet.tMax and returns the
+	// lanes that are done for good (e.g. occluded shadow rays).
+	template <class Visitor> void traversePacket(BVHPacket & packet, unsigned mask, Visitor & visit) const {
+
+		if (nodes.empty() || mask == 0)
+			return;
+
+		int stack[2 * stackSize];
+		unsigned stackMask[2 * stackSize];
+		int top = 0;
+
+		unsigned whole = mask;
+		float tMaxHi = packet.maxDistance(mask);
+
+		stack[top] = 0;
+		stackMask[top++] = mask;
+
+		while (top > 0) {
+
+			top--;
+			const BVHNode & node = nodes[stack[top]];
+			unsigned lanes = stackMask[top] & mask;
+			if (lanes == 0)
+				continue;
+
+			// while the packet is still whole the interval test rejects the
+			// node for all lanes at once
+			if (lanes == whole && packet.missesAll(node, tMaxHi))
+				continue;
+
+			lanes = packet.hits(node, lanes);
+			if (lanes == 0)
+				continue;
+
+			if (node.leaf()) {
+				mask &= ~visit(node.start, node.count, lanes);
+				if (mask == 0)
+					return;
+				continue;
+			}
+
+			// children ordered for the first remaining lane
+			int first = 0;
+			while (!((lanes >> first) & 1))
+				first++;
+
+			bool nearFirst = packet.entry(first, nodes[node.start]) <= packet.entry(first, nodes[node.start + 1]);
+
+			stack[top] = nearFirst ? node.start + 1 : node.start;
+			stackMask[top++] = lanes;
+			stack[top] = nearFirst ? node.start : node.start + 1;
+			stackMask[top++] = lanes;
+		}
+	}
+
+	// Visits leaves front to back. visit(start, count, tMax) tests the
+	// primitives indices[start, start + count) and shrinks tMax on a hit,
+	// returning true ends the traversal early.
+	template <class Visitor> void traverse(const BVHRay & ray, float & tMax, Visitor & visit) const {
+
+		if (nodes.empty())
+			return;
+
+		int stack[stackSize];
+		float stackDist[stackSize];
+		int top = 0;
+		int current = 0;
+
+		float t0, t1;
+		if (!ray.enter(nodes[0], tMax, t0))
+			return;
+
+		while (true) {
+
+			const BVHNode & node = nodes[current];
+			if (node.leaf()) {
+				if (visit(node.start, node.count, tMax))
+					return;
+			}
+			else {
+				bool hit0 = ray.enter(nodes[node.start], tMax, t0);
+				bool hit1 = ray.enter(nodes[node.start + 1], tMax, t1);
+
+				if (hit0 && hit1) {
+					if (t1 < t0) {
+						stackDist[top] = t0;
+						stack[top++] = node.start;
+						current = node.start + 1;
+					}
+					else {
+						stackDist[top] = t1;
+						stack[top++] = node.start + 1;
+						current = node.start;
+					}
+					continue;
+				}
+				if (hit0) {
+					current = node.start;
+					continue;
+				}
+				if (hit1) {
+					current = node.start + 1;
+					continue;
+				}
+			}
+
+			// skip subtrees that lie behind a hit found in the meantime
+			do {
+				if (top == 0)
+					return;
+				current = stack[--top];
+			} while (stackDist[top] > tMax);
+		}
+	}
+};
+
+#endif
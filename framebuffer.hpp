@@ -0,0 +1,149 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "world.hpp"
+
+enum FramebufferFormat
+{
+	FB_SRGB8,	// 3 bytes per pixel, sRGB encoded
+	FB_FLOAT	// 3 floats per pixel, linear
+};
+
+// Window sized pixel storage handed to the texture. Changes are tracked in
+// blocks of blockSize x blockSize pixels so only those get uploaded again.
+class Framebuffer
+{
+public:
+	enum { blockSize = 64 };
+
+	// A horizontal run of dirty blocks, in pixels.
+	struct Region
+	{
+		int left;
+		int bottom;
+		int width;
+		int height;
+	};
+
+private:
+	int width;
+	int height;
+	FramebufferFormat format;
+
+	std::vector<unsigned char> bytes;
+	std::vector<float> floats;
+
+	int blocksX;
+	int blocksY;
+	std::vector<unsigned char> dirty;
+	bool anyDirty;
+
+	// Linear to sRGB, indexed by the linear value in steps of 1/4095.
+	struct SrgbTable
+	{
+		unsigned char values[4096];
+
+		SrgbTable() {
+			for (int i = 0; i < 4096; i++) {
+				float v = i / 4095.0f;
+				float s = v <= 0.0031308f ? v * 12.92f : 1.055f * pow(v, 1.0f / 2.4f) - 0.055f;
+				values[i] = (unsigned char)(s * 255.0f + 0.5f);
+			}
+		}
+	};
+
+	static const unsigned char * srgbTable() {
+
+		static SrgbTable table;
+		return table.values;
+	}
+
+	static unsigned char encode(const unsigned char * table, float value) {
+		return table[(int)(std::min(1.0f, std::max(0.0f, value)) * 4095.0f + 0.5f)];
+	}
+
+public:
+	Framebuffer(int _width, int _height, FramebufferFormat _format)
+	: width(_width), height(_height), format(_format) {
+
+		if (format == FB_SRGB8)
+			bytes.assign(width * height * 3, 0);
+		else
+			floats.assign(width * height * 3, 0.0f);
+
+		blocksX = (width + blockSize - 1) / blockSize;
+		blocksY = (height + blockSize - 1) / blockSize;
+		markAll();
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	FramebufferFormat getFormat() const { return format; }
+	int pixelBytes() const { return format == FB_SRGB8 ? 3 : 3 * sizeof(float); }
+	int sizeBytes() const { return width * height * pixelBytes(); }
+	const void * data() const { return format == FB_SRGB8 ? (const void*)&bytes[0] : (const void*)&floats[0]; }
+
+	void set(int x, int y, const Color & color) {
+
+		int index = (y * width + x) * 3;
+		if (format == FB_SRGB8) {
+			const unsigned char * table = srgbTable();
+			bytes[index] = encode(table, color.r);
+			bytes[index + 1] = encode(table, color.g);
+			bytes[index + 2] = encode(table, color.b);
+		}
+		else {
+			floats[index] = color.r;
+			floats[index + 1] = color.g;
+			floats[index + 2] = color.b;
+		}
+	}
+
+	void mark(int left, int bottom, int right, int top) {
+
+		for (int by = bottom / blockSize; by <= (top - 1) / blockSize; by++)
+			for (int bx = left / blockSize; bx <= (right - 1) / blockSize; bx++)
+				dirty[by * blocksX + bx] = 1;
+		anyDirty = true;
+	}
+
+	void markAll() {
+
+		dirty.assign(blocksX * blocksY, 1);
+		anyDirty = true;
+	}
+
+	bool isDirty() const { return anyDirty; }
+
+	// Returns the dirty regions, merged along rows of blocks, and clears them.
+	std::vector<Region> takeDirty() {
+
+		std::vector<Region> regions;
+		for (int by = 0; by < blocksY && anyDirty; by++) {
+			for (int bx = 0; bx < blocksX; bx++) {
+
+				if (!dirty[by * blocksX + bx])
+					continue;
+
+				int end = bx;
+				while (end < blocksX && dirty[by * blocksX + end])
+					dirty[by * blocksX + end++] = 0;
+
+				Region region;
+				region.left = bx * blockSize;
+				region.bottom = by * blockSize;
+				region.width = std::min(width, end * blockSize) - region.left;
+				region.height = std::min(height, (by + 1) * blockSize) - region.bottom;
+				regions.push_back(region);
+				bx = end;
+			}
+		}
+		anyDirty = false;
+		return regions;
+	}
+};
+
+#endif
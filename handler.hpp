@@ -1,9 +1,20 @@
 #ifndef HANDLER_HPP
 #define HANDLER_HPP
 
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
 #include <GL/glut.h>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
 #include "world.hpp"
+#include "stats.hpp"
+#include "framebuffer.hpp"
+#include "renderer.hpp"
+#include "scene.hpp"
+#include "scheduler.hpp"
 
 using namespace std;
 
@@ -11,26 +22,149 @@ class DrawMode
 {
 protected: 
 	const Camera * camera;
-	const World * world;
 
 	int win_height;
 	int win_width;
-	int win_pow2;
 
-	float * texture;
+	Framebuffer * framebuffer;
+	FramebufferFormat format;
+
 	GLuint textureID;
+	GLuint pbos[2];
+	int pboIndex;
+	bool usePBO;
+	bool glReady;
 
 	bool done;
+	double waited;	// by the last drawBatch, for work to come in
+
+	typedef std::chrono::steady_clock Clock;
+
+	FrameStats frameStats;
+	RenderStats frameCounters;
+	Clock::time_point frameStart;
+	bool frameReported;
+
+	static double secondsSince(Clock::time_point start) {
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	void beginFrame() {
+
+		frameStats = FrameStats();
+		frameStats.width = win_width;
+		frameStats.height = win_height;
+		frameCounters = RenderStats::snapshot();
+		frameStart = Clock::now();
+		frameReported = false;
+		done = false;
+	}
+	// Passes may overlap, each one records the time since the frame started.
+	void endPass() {
+
+		frameStats.passSeconds.push_back(secondsSince(frameStart));
+	}
+	void endFrame() {
+
+		frameStats.seconds = secondsSince(frameStart);
+		frameStats.counters = RenderStats::snapshot() - frameCounters;
+		done = true;
+	}
+
+public:
+	static bool glVersionAtLeast(int major, int minor) {
+
+		int haveMajor = 0;
+		int haveMinor = 0;
+		const char * version = (const char*)glGetString(GL_VERSION);
+		if (!version || sscanf(version, "%d.%d", &haveMajor, &haveMinor) != 2)
+			return false;
+		return haveMajor > major || (haveMajor == major && haveMinor >= minor);
+	}
+
+	GLenum pixelType() const { return format == FB_SRGB8 ? GL_UNSIGNED_BYTE : GL_FLOAT; }
+
+	// Uploads the dirty regions of the framebuffer. With pixel buffer
+	// objects they are copied into one of two buffers, orphaned first so
+	// the copy never waits for the transfer of the previous upload, and
+	// the texture is filled from there asynchronously.
+	void upload() {
+
+		std::vector<Framebuffer::Region> regions = framebuffer->takeDirty();
+		if (regions.empty())
+			return;
+
+		int stride = win_width * framebuffer->pixelBytes();
+		const unsigned char * data = (const unsigned char*)framebuffer->data();
+		const unsigned char * source = data;
+
+		if (usePBO) {
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pboIndex]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, framebuffer->sizeBytes(), NULL, GL_STREAM_DRAW);
+			unsigned char * mapped = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+
+			if (mapped) {
+				for (int r = 0; r < regions.size(); r++) {
+					const Framebuffer::Region & region = regions[r];
+					for (int y = region.bottom; y < region.bottom + region.height; y++) {
+						int offset = y * stride + region.left * framebuffer->pixelBytes();
+						memcpy(mapped + offset, data + offset, region.width * framebuffer->pixelBytes());
+					}
+				}
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				source = NULL;
+			}
+			else {
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			pboIndex ^= 1;
+		}
+
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, win_width);
+		for (int r = 0; r < regions.size(); r++) {
+
+			const Framebuffer::Region & region = regions[r];
+			int offset = region.bottom * stride + region.left * framebuffer->pixelBytes();
+			glTexSubImage2D(GL_TEXTURE_2D, 0, region.left, region.bottom, region.width, region.height, 
+				GL_RGB, pixelType(), source + offset);
+
+			frameStats.uploadBytes += region.width * region.height * framebuffer->pixelBytes();
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+		if (usePBO)
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
 
 public:
-	DrawMode(Camera * _camera, World * _world) : camera(_camera), world(_world) {};
+	DrawMode(Camera * _camera)
+	: camera(_camera), framebuffer(NULL), format(FB_SRGB8)
+	, pboIndex(0), usePBO(false), glReady(false), waited(0.0), frameReported(true) {};
 	virtual ~DrawMode() {
 
-		delete[] texture;
+		delete framebuffer;
 	};
 
+	// Takes effect with the next updateWindowSize.
+	void setFramebufferFormat(FramebufferFormat _format) { format = _format; }
+
 	bool finished() const { return done; }
-	void draw() const { 
+	// Seconds the last drawBatch spent waiting rather than drawing.
+	double waitedSeconds() const { return waited; }
+
+	// Hands out the statistics of a finished frame, once per frame.
+	bool takeFrameStats(FrameStats & stats) {
+
+		if (!done || frameReported)
+			return false;
+
+		stats = frameStats;
+		frameReported = true;
+		return true;
+	}
+
+	void draw() { 
 
 		glClearColor(0, 0, 0, 0);
 	    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -44,7 +178,12 @@ public:
 
 	    glColor3f(1, 1, 1);
 
-	    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, win_pow2, win_pow2, 0, GL_RGB, GL_FLOAT, texture);
+	    if (framebuffer->isDirty()) {
+	    	Clock::time_point uploadStart = Clock::now();
+	    	upload();
+	    	frameStats.uploadSeconds += secondsSince(uploadStart);
+	    	frameStats.uploads++;
+	    }
 
 	    glBegin(GL_QUADS);
 	    glTexCoord2f(0, 0);
@@ -60,216 +199,326 @@ public:
 	    glutSwapBuffers();
 	}
 	void setFinishedState(bool state) { done = state; }
+	// The texture has exactly the window size. sRGB8 needs GL 2.1 (as do
+	// pixel buffer objects), float storage GL 3.0, otherwise the texture
+	// falls back to 8 bit and the framebuffer to float.
 	void updateWindowSize(int width, int height) {
-		
-		delete[] texture;
+
+		if (!glReady) {
+			glEnable(GL_TEXTURE_2D);
+			glGenTextures(1, &textureID);
+			usePBO = glVersionAtLeast(2, 1);
+			if (usePBO)
+				glGenBuffers(2, pbos);
+			glReady = true;
+		}
+		if (!glVersionAtLeast(2, 1))
+			format = FB_FLOAT;
 
 		win_width = width;
 		win_height = height;
-		win_pow2 = 1;
-		while (win_pow2 < win_width || win_pow2 < win_height)
-			win_pow2 *= 2;
 
-		texture = new float[win_pow2 * win_pow2 * 3];
+		delete framebuffer;
+		framebuffer = new Framebuffer(width, height, format);
+
+		GLint internal = GL_RGB;
+		if (format == FB_SRGB8)
+			internal = GL_SRGB8;
+		else if (glVersionAtLeast(3, 0))
+			internal = GL_RGB32F;
 
-		glEnable(GL_TEXTURE_2D);
-	    glGenTextures(1, &textureID);
 	    glBindTexture(GL_TEXTURE_2D, textureID);
-	    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, win_pow2, win_pow2, 0, GL_RGB, GL_FLOAT, texture);
+	    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	    glTexImage2D(GL_TEXTURE_2D, 0, internal, win_width, win_height, 0, GL_RGB, pixelType(), NULL);
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
 	virtual void updateWindowContent() = 0;
+	// Quick frame while the camera moves, estimated to cast at most rays rays.
+	virtual void updateWindowContentInMotion(int rays) { updateWindowContent(); }
+	// Frame after lights or surfaces changed but the camera did not. With
+	// visibility a light moved and the shadows may have changed.
+	virtual void updateWindowContentRelit(bool visibility) { updateWindowContent(); }
+	// Forgets what the last frames left behind for the next ones, after
+	// the objects changed.
+	virtual void invalidateHistory() {}
 	virtual void drawNext() = 0;
+	// Does up to batchSize steps, returns how many it did.
+	virtual int drawBatch(int batchSize) {
+
+		int count = 0;
+		for (; count < batchSize && !done; count++)
+			drawNext();
+		return count;
+	}
 };
 
-class DM_Iterative : public DrawMode
+// Copies the tiles of the TileRenderer into the texture as they finish.
+// A sample covers its step x step block, but never paints over a pixel that
+// a finer sample has painted already, so levels may finish in any order.
+class DM_Tiled : public DrawMode
 {
 private:
-	int win_size_pad;
-	int tile_size;
+	TileRenderer renderer;
 
-	int tile_bottom;
-	int tile_left;
+	std::vector<int> painted;
+	std::vector<int> levelCollected;
+	int motionStep;
+	bool motionExact;
 
-public: 
-	DM_Iterative(Camera * _camera, World * _world) : DrawMode(_camera, _world) {}
+	void composite(const Tile * tile) {
 
-	virtual void updateWindowContent() {
+		for (int j = 0; j < tile->height; j++) {
+			for (int i = 0; i < tile->width; i++) {
 
-		int tmp = 1;
-		while (tmp < win_height || tmp < win_width)
-			tmp <<= 1;
-		win_size_pad = tmp;
-		tile_size = win_size_pad;
+				if (!tile->traced(i, j))
+					continue;
 
-		tile_bottom = 0;
-		tile_left = 0;
+				const Color & color = tile->pixels[j * tile->width + i];
+				int left = tile->left + i * tile->step;
+				int bottom = tile->bottom + j * tile->step;
+				int right = min(win_width, left + tile->step);
+				int top = min(win_height, bottom + tile->step);
 
-		done = false;
+				for (int y = bottom; y < top; y++) {
+					for (int x = left; x < right; x++) {
+
+						if (painted[y * win_width + x] <= tile->step)
+							continue;
+						painted[y * win_width + x] = tile->step;
+
+						framebuffer->set(x, y, color);
+					}
+				}
+			}
+		}
+
+		framebuffer->mark(tile->left, tile->bottom, 
+			min(win_width, tile->left + tile->width * tile->step), 
+			min(win_height, tile->bottom + tile->height * tile->step));
 	}
-	virtual void drawNext() {
 
-		Ray ray = camera->getRay(tile_left, tile_bottom);
-		Color color = world->getColor(ray);
+protected:
+	// Spacing of the samples of the first level, a power of two.
+	virtual int coarsestStep() const { return 1; }
+
+	void start(int coarsest, int finest) {
 
-		drawRect(	min(win_width - 1, tile_left + tile_size), 
-					tile_bottom, 
-					min(win_width - 1, tile_left + tile_size + tile_size), 
-					min(win_height - 1, tile_bottom + tile_size),
-					color);
+		renderer.start(camera, win_width, win_height, coarsest, finest);
+		started(finest);
+	}
+	void started(int finest) {
+
+		// the last frame stays visible until the new samples cover it
+		painted.assign(win_width * win_height, std::numeric_limits<int>::max());
+		levelCollected.assign(renderer.levels(), 0);
+		beginFrame();
+		frameStats.finestStep = finest;
+	}
 
-		drawRect(	tile_left, 
-					min(win_height - 1, tile_bottom + tile_size), 
-					min(win_width - 1, tile_left + tile_size), 
-					min(win_height - 1, tile_bottom + tile_size + tile_size),
-					color);
+public:
+	DM_Tiled(Camera * _camera, const WorldVersions * _versions, int threads)
+	: DrawMode(_camera), renderer(_versions, threads), motionStep(0), motionExact(false) {}
+	virtual ~DM_Tiled() {
 
-		drawRect(	min(win_width - 1, tile_left + tile_size), 
-					min(win_height - 1, tile_bottom + tile_size),
-					min(win_width - 1, tile_left + tile_size + tile_size), 
-					min(win_height - 1, tile_bottom + tile_size + tile_size),
-					color);
+		renderer.cancel();
+	}
 
-		tile_bottom += tile_size + tile_size;
+	// After motion the refinement starts no coarser than the motion frame,
+	// on the same grid as both steps are powers of two, and a finished,
+	// traced motion frame at full resolution is kept as it is.
+	virtual void updateWindowContent() {
 
-		if (tile_bottom >= win_height) {
-			tile_bottom = 0;
-			tile_left += tile_size + tile_size;
+		if (motionStep == 1 && motionExact && done) {
+			motionStep = 0;
+			return;
 		}
-		if (tile_left >= win_width) {
-			tile_bottom = 0;
-			tile_left = 0;
-
-			if (tile_size <= 1)
-				done = true;
-			else
-				tile_size >>= 1;
+
+		int coarsest = coarsestStep();
+		while (motionStep > 0 && coarsest > motionStep)
+			coarsest >>= 1;
+		motionStep = 0;
+
+		start(coarsest, 1);
+	}
+	// The last complete frame reprojected into the new view, or a single
+	// level whose samples cover step x step pixels each, whichever
+	// TileRenderer::startMotion() finds within rays.
+	virtual void updateWindowContentInMotion(int rays) {
+
+		bool reprojected;
+		motionStep = renderer.startMotion(camera, win_width, win_height, rays, reprojected);
+		motionExact = !reprojected;
+		started(motionStep);
+	}
+	// Only shades the records of the last complete frame again when it was
+	// taken from this view.
+	virtual void updateWindowContentRelit(bool visibility) {
+
+		if (renderer.startRelit(camera, win_width, win_height, visibility)) {
+			motionStep = 0;
+			started(1);
+			return;
 		}
+
+		updateWindowContent();
 	}
-	void drawRect(int left, int bottom, int right, int top, const Color & color) {
+	virtual void invalidateHistory() {
 
-		for (int i = bottom; i < top; i++) {
-			for (int j = left; j < right; j++) {
+		renderer.invalidateHistory();
+		motionStep = 0;
+	}
+	virtual void drawNext() {
 
-				int index = (i * win_pow2 + j) * 3;
-				texture[index] = color.r;
-				texture[index + 1] = color.g;
-				texture[index + 2] = color.b;
-			}
+		drawBatch(1);
+	}
+	// Copies up to batchSize of the tiles the workers have finished, waiting
+	// briefly for the first one so the GLUT thread does not spin.
+	virtual int drawBatch(int batchSize) {
+
+		int count = 0;
+		Clock::time_point waitStart = Clock::now();
+		Tile * tile = renderer.next(2);
+		waited = secondsSince(waitStart);
+		while (tile) {
+
+			composite(tile);
+			if (++levelCollected[tile->level] == renderer.tilesInLevel(tile->level))
+				endPass();
+
+			delete tile;
+			tile = ++count < batchSize ? renderer.next(0) : NULL;
 		}
 
+		if (renderer.finished())
+			endFrame();
+		return count;
 	}
 };
 
+// Progressive refinement: the first level traces one sample per block of
+// the padded window size, every further level halves the block size.
+class DM_Iterative : public DM_Tiled
+{
+protected:
+	virtual int coarsestStep() const {
+
+		int step = 1;
+		while (step < win_height || step < win_width)
+			step <<= 1;
+		return step;
+	}
+
+public: 
+	DM_Iterative(Camera * _camera, const WorldVersions * _versions, int threads) : DM_Tiled(_camera, _versions, threads) {}
+};
+
+// What an edit of the world changes, and so how much of the last frame
+// still holds.
+enum EditEffect { EDIT_SHADING, EDIT_LIGHTS, EDIT_GEOMETRY };
+
 class Handler
 {
 private:
-	int batch_size;
+	typedef std::chrono::steady_clock Clock;
+
 	int window_width;
 	int window_height;
 
+	// While input keeps coming, frames are rendered with an estimated
+	// motion_rays rays, primary, shadow and mirror ones alike; full
+	// refinement resumes once no input arrived for motion_settle seconds.
+	int motion_rays;
+	double motion_settle;
+	bool moving;
+	Clock::time_point last_input;
+
 public:
-	World * world;
+	Scene * scene;
+	WorldVersions * versions;	// holds the world of the scene
 	Camera * camera;
 	DrawMode * drawmode;
+	BatchScheduler scheduler;
 
 	Handler() {
 
-		batch_size = 1000;
 		window_width = 1024;
 		window_height = 1024;
 
-		Vec3<float> origin(-14.0f, 40.0f, -40.0f);
-		float rotationHorizontal = 0.68f;
-		float rotationVertical = 0.25f;
-		float viewPort = 1.5f;
-
-		camera = new Cam_Std(	
-			window_width, 
-			window_height, 
-			origin, 
-			rotationHorizontal, 
-			rotationVertical, 
-			viewPort);
-
-		world = new World();
-
-		// lights
+		motion_rays = TileRenderer::defaultMotionRays;
+		motion_settle = 0.2;
+		moving = false;
 
-		Color l1Color(1.0f, 1.0f, 1.0f);
-		Vec3<float> l1Origin(0.0f, 100.0f, 0.0f);
-		world->addLight(new Light(l1Color, l1Origin));
+		scene = defaultScene(window_width, window_height);
+		versions = new WorldVersions(scene->world);
+		scene->world.reset();
+		camera = scene->camera;
 
-		Color l2Color(1.0f, 1.0f, 1.0f);
-		Vec3<float> l2Origin(-30.0f, 50.0f, 0.15f);
-		world->addLight(new Light(l2Color, l2Origin));
-
-		// objects
-
-		Surface * p1Surface = new Surface();
-		p1Surface->setColor(0.8f, 0.8f, 0.8f);
-		p1Surface->setMirror(0.1f);
-
-		Vec3<float> p1Origin(0.0f, 0.0f, 0.0f);
-		Vec3<float> p1Normal(0.0f, 1.0f, 0.0f);
-		world->addWorldObject(new WO_Plane(p1Surface, p1Origin, p1Normal));
-
-
-		Surface * p2Surface = new Surface();
-		p2Surface->setColor(0.0f, 1.0f, 0.0f);
-
-		Vec3<float> p2Origin(5.0f, 5.0f, 0.0f);
-		Vec3<float> p2Normal(-1.0f, 0.5f, -1.0f);
-		world->addWorldObject(new WO_Plane(p2Surface, p2Origin, p2Normal));
-
-
-		Surface * s1Surface = new Surface();
-		s1Surface->setColor(0.3f, 0.3f, 1.0f);
-		//s1Surface->setShadingModel(0.0f, 0.3f, 0.7f);
-		s1Surface->setMirror(0.3f);
-		
-		Vec3<float> s1Origin(-5.0f, 5.0f, 0.0f);
-		float s1Radius = 10.0f;
-		world->addWorldObject(new WO_Sphere(s1Surface, s1Origin, s1Radius));
+		drawmode = new DM_Iterative(camera, versions, ThreadPool::hardwareThreads());
 
+	}
 
-		Surface * s2Surface = new Surface();
-		s2Surface->setColor(0.0f, 1.0f, 1.0f);
+	~Handler() {
+		delete drawmode;
+		delete versions;
+		delete scene;
+	}
 
-		Vec3<float> s2Origin(-5.0f, 40.0f, -20.0f);
-		float s2Radius = 3.0f;
-		world->addWorldObject(new WO_Sphere(s2Surface, s2Origin, s2Radius));
+	// Shows another scene, before the window is created.
+	void setScene(Scene * _scene) {
 
+		delete drawmode;
+		delete versions;
+		delete scene;
 
-		Surface * s3Surface = new Surface();
-		s3Surface->setColor(1.0f, 0.0f, 1.0f);
+		scene = _scene;
+		versions = new WorldVersions(scene->world);
+		scene->world.reset();
+		camera = scene->camera;
+		camera->resize(window_width, window_height);
 
-		Vec3<float> s3Origin(-25.0f, 15.0f, -30.0f);
-		float s3Radius = 10.0f;
-		world->addWorldObject(new WO_Sphere(s3Surface, s3Origin, s3Radius));
+		drawmode = new DM_Iterative(camera, versions, ThreadPool::hardwareThreads());
+	}
 
+	int getWindowWidth() { return window_width; }
+	int getWindowHeight() { return window_height; }
+	void setMotionRays(int rays) { motion_rays = std::max(1, rays); }
+	void setMotionSettle(double seconds) { motion_settle = seconds; }
+	bool isMoving() const { return moving; }
 
-		Surface * s4Surface = new Surface();
-		s4Surface->setColor(1.0f, 1.0f, 0.0f);
+	// Called after the camera changed because of input.
+	void moved() {
 
-		Vec3<float> s4Origin(-40.0f, 10.0f, 0.0f);
-		float s4Radius = 10.0f;
-		world->addWorldObject(new WO_Sphere(s4Surface, s4Origin, s4Radius));
+		last_input = Clock::now();
+		moving = true;
+		drawmode->updateWindowContentInMotion(motion_rays);
+	}
+	// Restarts full refinement when the input has settled. Returns whether
+	// it did.
+	bool settle() {
 
-		drawmode = new DM_Iterative(camera, world);
+		if (!moving || std::chrono::duration<double>(Clock::now() - last_input).count() < motion_settle)
+			return false;
 
+		moving = false;
+		drawmode->updateWindowContent();
+		return true;
 	}
+	// Publishes change(world) applied to a clone of the current world, see
+	// WorldVersions; the frame in flight goes on with the version it has.
+	// Changes of surfaces and lights shade the last frame again, moved
+	// objects have it traced anew.
+	template <class Change> void edit(Change change, EditEffect effect) {
 
-	~Handler() {
-		delete world;
-		delete camera;
-		delete drawmode;
-	}
+		versions->edit(change);
 
-	int getBatchSize() { return batch_size; }
-	int getWindowWidth() { return window_width; }
-	int getWindowHeight() { return window_height; }
+		if (effect == EDIT_GEOMETRY) {
+			drawmode->invalidateHistory();
+			drawmode->updateWindowContent();
+		}
+		else
+			drawmode->updateWindowContentRelit(effect == EDIT_LIGHTS);
+	}
 	void glInit() { 
 		drawmode->updateWindowSize(window_width, window_height); 
 		drawmode->updateWindowContent();
@@ -0,0 +1,183 @@
+#include "loader.hpp"
+#include "renderer.hpp"
+#include "image.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+// Renders one frame without a window and writes it to disk.
+//
+//   raytracer_headless [-w width] [-h height] [-t threads] [-m wavefront|recursive]
+//                      [-q min-throughput] [-r] [-c] [-o out.ppm|out.pfm] [-s out.snapshot] [scene]
+//
+// scene is a scene file as read by SceneLoader or a snapshot, by default the
+// demo scene is rendered. -s also writes the built scene as a snapshot.
+// -q leaves out mirror reflections whose share of the pixel drops below
+// min-throughput, -r decides those by Russian roulette instead and -c
+// renders a reference without either, to report the rays saved and the
+// error they cost.
+
+typedef std::chrono::steady_clock Clock;
+
+void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-t threads] [-m wavefront|recursive] "
+        "[-q min-throughput] [-r] [-c] [-o out.ppm|out.pfm] [-s out.snapshot] [scene]\n", name);
+    exit(1);
+}
+
+FrameStats render(const Scene * scene, int threads, Image & image) {
+
+    TileRenderer renderer(scene->world.get(), threads);
+    RenderStats before = RenderStats::snapshot();
+
+    Clock::time_point start = Clock::now();
+    renderer.start(scene->camera, image.width, image.height);
+
+    while (!renderer.finished()) {
+
+        Tile * tile = renderer.next(100);
+        if (!tile)
+            continue;
+
+        for (int y = 0; y < tile->height; y++)
+            for (int x = 0; x < tile->width; x++)
+                image.at(tile->left + x, tile->bottom + y) = tile->pixels[y * tile->width + x];
+
+        delete tile;
+    }
+
+    FrameStats stats;
+    stats.width = image.width;
+    stats.height = image.height;
+    stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    stats.passSeconds.push_back(stats.seconds);
+    stats.counters = RenderStats::snapshot() - before;
+    return stats;
+}
+
+int main(int argc, char **argv) {
+
+    int width = 1024;
+    int height = 1024;
+    int threads = ThreadPool::hardwareThreads();
+    std::string output = "out.ppm";
+    std::string scenePath;
+    std::string snapshotPath;
+    ShadingMode mode = SHADE_WAVEFRONT;
+    float minThroughput = 0.0f;
+    bool roulette = false;
+    bool compare = false;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "-r") == 0) {
+            roulette = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-c") == 0) {
+            compare = true;
+            continue;
+        }
+        if (argv[i][0] != '-') {
+            scenePath = argv[i];
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            usage(argv[0]);
+
+        if (strcmp(argv[i], "-w") == 0)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0)
+            height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0)
+            output = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0)
+            snapshotPath = argv[++i];
+        else if (strcmp(argv[i], "-q") == 0)
+            minThroughput = atof(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && strcmp(argv[i + 1], "wavefront") == 0)
+            mode = SHADE_WAVEFRONT, i++;
+        else if (strcmp(argv[i], "-m") == 0 && strcmp(argv[i + 1], "recursive") == 0)
+            mode = SHADE_RECURSIVE, i++;
+        else
+            usage(argv[0]);
+    }
+
+    if (width <= 0 || height <= 0 || threads <= 0 || minThroughput < 0.0f)
+        usage(argv[0]);
+
+    Clock::time_point loadStart = Clock::now();
+    Scene * scene = loadScene(scenePath, width, height);
+    if (!scene)
+        return 1;
+    double loadSeconds = std::chrono::duration<double>(Clock::now() - loadStart).count();
+
+    std::string error;
+    if (!snapshotPath.empty() && !SnapshotWriter().write(snapshotPath, scene, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    scene->world->setShadingMode(mode);
+    scene->world->setTermination(minThroughput, roulette);
+
+    Image image(width, height);
+    FrameStats stats = render(scene, threads, image);
+
+    if (!image.write(output)) {
+        fprintf(stderr, "could not write %s\n", output.c_str());
+        return 1;
+    }
+
+    printf("%dx%d on %d threads -> %s\n", width, height, threads, output.c_str());
+    printf("scene     %d objects, loaded in %.3f s\n", scene->world->objectCount(), loadSeconds);
+    long triangles, instances;
+    size_t meshBytes;
+    scene->world->meshStats(triangles, meshBytes, instances);
+    if (triangles > 0)
+        printf("meshes    %ld triangles, %.1f bytes each, %.0f loaded/sec\n", triangles,
+            (double)meshBytes / triangles, triangles / loadSeconds);
+    if (instances > 0)
+        printf("instances %ld\n", instances);
+    printf("time      %.3f s\n", stats.seconds);
+    printf("rays      %lu\n", stats.counters.rays());
+    printf("rays/sec  %.0f\n", stats.counters.rays() / stats.seconds);
+
+    if (compare) {
+
+        Image reference(width, height);
+        scene->world->setTermination(0.0f, false);
+        FrameStats full = render(scene, threads, reference);
+
+        double maxError = 0.0;
+        double sumSquares = 0.0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const Color & a = image.at(x, y);
+                const Color & b = reference.at(x, y);
+                float channels[3] = { a.r - b.r, a.g - b.g, a.b - b.b };
+                for (int c = 0; c < 3; c++) {
+                    maxError = std::max(maxError, (double)fabs(channels[c]));
+                    sumSquares += channels[c] * channels[c];
+                }
+            }
+        }
+
+        long saved = (long)full.counters.rays() - (long)stats.counters.rays();
+        printf("reference %lu rays, %.3f s\n", full.counters.rays(), full.seconds);
+        printf("saved     %ld rays (%.1f%%), %.1f%% of the time\n", saved,
+            100.0 * saved / full.counters.rays(), 100.0 * (1.0 - stats.seconds / full.seconds));
+        printf("error     max %.6f, rms %.6f\n", maxError, sqrt(sumSquares / (3.0 * width * height)));
+    }
+
+    printf("%s\n", stats.json().c_str());
+    delete scene;
+    return 0;
+}
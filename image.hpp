@@ -0,0 +1,83 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include <vector>
+#include <cstdio>
+#include <string>
+#include "world.hpp"
+
+// Float RGB image, row 0 is the bottom row like in the window texture.
+class Image
+{
+public:
+	int width;
+	int height;
+	std::vector<Color> pixels;
+
+	Image(int _width, int _height) : width(_width), height(_height), pixels(_width * _height) {}
+
+	Color & at(int x, int y) { return pixels[y * width + x]; }
+	const Color & at(int x, int y) const { return pixels[y * width + x]; }
+
+	// 8 bit binary PPM, written top row first.
+	bool writePPM(const std::string & path) const {
+
+		FILE * file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+
+		fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+		std::vector<unsigned char> row(width * 3);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++) {
+				const Color & color = at(x, y);
+				row[x * 3] = toByte(color.r);
+				row[x * 3 + 1] = toByte(color.g);
+				row[x * 3 + 2] = toByte(color.b);
+			}
+			fwrite(&row[0], 1, row.size(), file);
+		}
+
+		return fclose(file) == 0;
+	}
+
+	// Little endian float PFM, which stores the bottom row first.
+	bool writePFM(const std::string & path) const {
+
+		FILE * file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+
+		fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+		std::vector<float> row(width * 3);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				const Color & color = at(x, y);
+				row[x * 3] = color.r;
+				row[x * 3 + 1] = color.g;
+				row[x * 3 + 2] = color.b;
+			}
+			fwrite(&row[0], sizeof(float), row.size(), file);
+		}
+
+		return fclose(file) == 0;
+	}
+
+	// Picks the format from the extension, PFM for ".pfm" and PPM otherwise.
+	bool write(const std::string & path) const {
+
+		if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0)
+			return writePFM(path);
+		return writePPM(path);
+	}
+
+private:
+	static unsigned char toByte(float value) {
+
+		return (unsigned char)(fmin(1.0f, fmax(0.0f, value)) * 255.0f + 0.5f);
+	}
+};
+
+#endif
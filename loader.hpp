@@ -0,0 +1,555 @@
+#ifndef LOADER_HPP
+#define LOADER_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include "scene.hpp"
+#include "snapshot.hpp"
+
+// Hands out the lines of a text file read in blocks, never as a whole.
+// A line is terminated in place and valid until the next one is read.
+class LineReader
+{
+private:
+	enum { blockSize = 1 << 16 };
+
+	FILE * file;
+	std::vector<char> buffer;
+	size_t begin;	// start of the next line in buffer
+	size_t end;	// end of the data read so far
+	bool eof;
+	long line;
+
+public:
+	LineReader() : file(NULL), begin(0), end(0), eof(false), line(0) {}
+	~LineReader() { close(); }
+
+	bool open(const std::string & path) {
+
+		close();
+		file = fopen(path.c_str(), "rb");
+		buffer.assign(blockSize + 1, '\0');
+		begin = end = 0;
+		eof = false;
+		line = 0;
+		return file != NULL;
+	}
+
+	void close() {
+
+		if (file)
+			fclose(file);
+		file = NULL;
+		std::vector<char>().swap(buffer);
+	}
+
+	// Number of the line read last.
+	long lineNumber() const { return line; }
+
+	// The next line without its newline. False at the end of the file.
+	bool next(char *& text) {
+
+		while (true) {
+
+			char * start = &buffer[begin];
+			char * newline = (char*)memchr(start, '\n', end - begin);
+			if (newline) {
+				*newline = '\0';
+				text = start;
+				begin = newline + 1 - &buffer[0];
+				line++;
+				return true;
+			}
+
+			if (eof) {
+				if (begin == end)
+					return false;
+				// the last line lacks its newline
+				buffer[end] = '\0';
+				text = start;
+				begin = end;
+				line++;
+				return true;
+			}
+
+			// keep the partial line and read the next block behind it
+			memmove(&buffer[0], start, end - begin);
+			end -= begin;
+			begin = 0;
+			if (end + blockSize + 1 > buffer.size())
+				buffer.resize(end + blockSize + 1);
+
+			size_t n = fread(&buffer[end], 1, blockSize, file);
+			end += n;
+			eof = n == 0;
+		}
+	}
+
+	// The next whitespace separated word, terminated in place, or NULL.
+	static char * word(char *& cursor) {
+
+		while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+			cursor++;
+		if (*cursor == '\0')
+			return NULL;
+
+		char * start = cursor;
+		while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+			cursor++;
+		if (*cursor != '\0')
+			*cursor++ = '\0';
+		return start;
+	}
+};
+
+// Reads the vertices and faces of a Wavefront OBJ file into a TriangleMesh,
+// block by block like SceneLoader. Polygons are split into fans around
+// their first corner. Texture coordinates, normals, groups and materials
+// are skipped.
+class ObjLoader
+{
+private:
+	LineReader reader;
+	std::string error;
+
+	std::vector<float> vertices;
+	std::vector<int> indices;
+	std::vector<int> corners;
+
+	bool fail(const std::string & message) {
+
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), ":%ld: ", reader.lineNumber());
+		error = prefix + message;
+		return false;
+	}
+
+	bool vertex(char * cursor) {
+
+		for (int i = 0; i < 3; i++) {
+			char * text = LineReader::word(cursor);
+			if (!text)
+				return fail("coordinate expected");
+
+			char * stop;
+			vertices.push_back(strtof(text, &stop));
+			if (*stop != '\0')
+				return fail(std::string("not a number: ") + text);
+		}
+		return true;
+	}
+
+	// Corners are v, v/vt, v//vn or v/vt/vn, counted from 1 or, if
+	// negative, back from the last vertex read.
+	bool face(char * cursor) {
+
+		corners.clear();
+		for (char * text = LineReader::word(cursor); text; text = LineReader::word(cursor)) {
+
+			char * stop;
+			long index = strtol(text, &stop, 10);
+			if (stop == text || (*stop != '\0' && *stop != '/'))
+				return fail(std::string("not a vertex index: ") + text);
+
+			long count = vertices.size() / 3;
+			index = index < 0 ? count + index : index - 1;
+			if (index < 0 || index >= count)
+				return fail(std::string("no such vertex: ") + text);
+			corners.push_back((int)index);
+		}
+
+		if (corners.size() < 3)
+			return fail("a face needs three corners");
+
+		for (int i = 2; i < corners.size(); i++) {
+			indices.push_back(corners[0]);
+			indices.push_back(corners[i - 1]);
+			indices.push_back(corners[i]);
+		}
+		return true;
+	}
+
+public:
+	// The mesh in path, NULL if it cannot be read, see getError().
+	std::shared_ptr<const TriangleMesh> load(const std::string & path) {
+
+		if (!reader.open(path)) {
+			error = path + ": cannot open";
+			return std::shared_ptr<const TriangleMesh>();
+		}
+
+		vertices.clear();
+		indices.clear();
+
+		char * text;
+		bool ok = true;
+		while (ok && reader.next(text)) {
+
+			char * cursor = text;
+			char * keyword = LineReader::word(cursor);
+			if (!keyword)
+				continue;
+			if (strcmp(keyword, "v") == 0)
+				ok = vertex(cursor);
+			else if (strcmp(keyword, "f") == 0)
+				ok = face(cursor);
+		}
+		reader.close();
+
+		if (ok && indices.empty())
+			ok = fail("no faces");
+		if (!ok) {
+			error = path + error;
+			return std::shared_ptr<const TriangleMesh>();
+		}
+
+		return std::make_shared<TriangleMesh>(vertices, indices);
+	}
+
+	const std::string & getError() const { return error; }
+};
+
+// Reads a scene from a text file, one statement per line:
+//
+//   # comment
+//   camera x y z horizontal vertical viewport
+//   light r g b x y z
+//   surface name [pattern] [color r g b] [shading ambient diffuse specular]
+//                [phong exponent] [mirror coefficient]
+//   sphere surface x y z radius
+//   plane surface x y z nx ny nz
+//   mesh surface file.obj
+//   instance surface file.obj x y z [scale s | scale sx sy sz] [rotate ax ay az]
+//
+// Surfaces are named before the primitives use them, the options left out
+// keep the defaults of Surface. Without a camera line the camera of the
+// demo scene is used. The file is read in blocks, never as a whole, and
+// the primitives go straight into the World, so scenes of millions of
+// spheres load in seconds. OBJ files are found relative to the scene file,
+// one named twice is read once and shared: an instance costs its transform,
+// not a copy of the triangles.
+class SceneLoader
+{
+private:
+	LineReader reader;
+	std::string directory;
+	std::string error;
+
+	World * world;
+	std::unordered_map<std::string, Surface*> surfaces;
+	std::unordered_map<std::string, std::shared_ptr<const TriangleMesh> > meshes;
+	std::string lastName;
+	Surface * lastSurface;
+
+	bool hasCamera;
+	Vec3<float> cameraOrigin;
+	float cameraHorizontal;
+	float cameraVertical;
+	float cameraViewPort;
+
+	static char * word(char *& cursor) { return LineReader::word(cursor); }
+
+	bool fail(const std::string & message) {
+
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), ":%ld: ", reader.lineNumber());
+		error = prefix + message;
+		return false;
+	}
+
+	bool numbers(char *& cursor, float * values, int count) {
+
+		for (int i = 0; i < count; i++) {
+			char * text = word(cursor);
+			if (!text)
+				return fail("number expected");
+
+			char * stop;
+			values[i] = strtof(text, &stop);
+			if (*stop != '\0')
+				return fail(std::string("not a number: ") + text);
+		}
+		return true;
+	}
+
+	bool surface(char *& cursor, Surface *& result) {
+
+		char * name = word(cursor);
+		if (!name)
+			return fail("surface name expected");
+
+		if (lastSurface && lastName == name) {
+			result = lastSurface;
+			return true;
+		}
+
+		std::unordered_map<std::string, Surface*>::iterator found = surfaces.find(name);
+		if (found == surfaces.end())
+			return fail(std::string("unknown surface ") + name);
+
+		lastName = name;
+		lastSurface = result = found->second;
+		return true;
+	}
+
+	// The mesh of the OBJ file named next, read once per scene.
+	bool mesh(char *& cursor, std::shared_ptr<const TriangleMesh> & result) {
+
+		char * file = word(cursor);
+		if (!file)
+			return fail("mesh file expected");
+
+		std::string path = file[0] == '/' ? std::string(file) : directory + file;
+		std::shared_ptr<const TriangleMesh> & cached = meshes[path];
+		if (!cached) {
+			ObjLoader obj;
+			cached = obj.load(path);
+			if (!cached)
+				return fail(obj.getError());
+		}
+		result = cached;
+		return true;
+	}
+
+	// x y z [scale s | scale sx sy sz] [rotate ax ay az]: scaled, rotated
+	// about x, y and z by degrees in that order, then moved to x y z.
+	bool transform(char *& cursor, Transform<float> & result) {
+
+		float offset[3];
+		if (!numbers(cursor, offset, 3))
+			return false;
+
+		std::vector<char *> options;
+		for (char * option = word(cursor); option; option = word(cursor)) {
+			if (option[0] == '#') {
+				cursor += strlen(cursor);
+				break;
+			}
+			options.push_back(option);
+		}
+
+		Transform<float> scale, rotation;
+		for (int i = 0; i < options.size(); i++) {
+
+			const char * option = options[i];
+			int count = 0;
+			float values[3];
+			while (count < 3 && i + 1 + count < options.size()) {
+				char * stop;
+				values[count] = strtof(options[i + 1 + count], &stop);
+				if (*stop != '\0')
+					break;
+				count++;
+			}
+
+			if (strcmp(option, "scale") == 0 && (count == 1 || count == 3)) {
+				scale = count == 1 ? Transform<float>::scale(values[0], values[0], values[0])
+					: Transform<float>::scale(values[0], values[1], values[2]);
+			}
+			else if (strcmp(option, "rotate") == 0 && count == 3) {
+				float radians = (float)M_PI / 180.0f;
+				rotation = Transform<float>::rotateZ(values[2] * radians) * Transform<float>::rotateY(values[1] * radians)
+					* Transform<float>::rotateX(values[0] * radians);
+			}
+			else {
+				return fail(std::string("unexpected ") + option);
+			}
+			i += count;
+		}
+
+		result = Transform<float>::translate(Vec3<float>(offset[0], offset[1], offset[2])) * rotation * scale;
+		return true;
+	}
+
+	bool defineSurface(char *& cursor) {
+
+		char * name = word(cursor);
+		if (!name)
+			return fail("surface name expected");
+		if (surfaces.count(name))
+			return fail(std::string("surface defined twice: ") + name);
+
+		std::vector<char *> options;
+		for (char * option = word(cursor); option; option = word(cursor)) {
+			if (option[0] == '#') {
+				cursor += strlen(cursor);
+				break;
+			}
+			options.push_back(option);
+		}
+
+		bool pattern = false;
+		for (int i = 0; i < options.size(); i++)
+			pattern = pattern || strcmp(options[i], "pattern") == 0;
+
+		Surface * surf = world->addSurface(pattern ? new S_Pattern() : new Surface());
+		surfaces[name] = surf;
+
+		for (int i = 0; i < options.size(); i++) {
+
+			const char * option = options[i];
+			int count = strcmp(option, "color") == 0 || strcmp(option, "shading") == 0 ? 3
+				: strcmp(option, "phong") == 0 || strcmp(option, "mirror") == 0 ? 1 : 0;
+
+			if (count == 0 && strcmp(option, "pattern") != 0)
+				return fail(std::string("unknown surface option ") + option);
+			if (i + count >= options.size())
+				return fail(std::string("too few values for ") + option);
+
+			float values[3];
+			for (int k = 0; k < count; k++) {
+				char * stop;
+				values[k] = strtof(options[i + 1 + k], &stop);
+				if (*stop != '\0')
+					return fail(std::string("not a number: ") + options[i + 1 + k]);
+			}
+			i += count;
+
+			if (strcmp(option, "color") == 0)
+				surf->setColor(values[0], values[1], values[2]);
+			else if (strcmp(option, "shading") == 0)
+				surf->setShadingModel(values[0], values[1], values[2]);
+			else if (strcmp(option, "phong") == 0)
+				surf->setPhongModel((int)values[0]);
+			else if (strcmp(option, "mirror") == 0)
+				surf->setMirror(values[0]);
+		}
+		return true;
+	}
+
+	bool statement(char * cursor) {
+
+		char * keyword = word(cursor);
+		if (!keyword || keyword[0] == '#')
+			return true;
+
+		float v[6];
+		Surface * surf;
+
+		if (strcmp(keyword, "sphere") == 0) {
+			if (!surface(cursor, surf) || !numbers(cursor, v, 4))
+				return false;
+			if (!(v[3] > 0.0f))
+				return fail("radius must be positive");
+			world->addSphere(surf, Vec3<float>(v[0], v[1], v[2]), v[3]);
+		}
+		else if (strcmp(keyword, "plane") == 0) {
+			if (!surface(cursor, surf) || !numbers(cursor, v, 6))
+				return false;
+			if (!(Vec3<float>(v[3], v[4], v[5]).length() > 0.0f))
+				return fail("plane normal is zero");
+			world->addPlane(surf, Vec3<float>(v[0], v[1], v[2]), Vec3<float>(v[3], v[4], v[5]));
+		}
+		else if (strcmp(keyword, "mesh") == 0) {
+			std::shared_ptr<const TriangleMesh> shared;
+			if (!surface(cursor, surf) || !mesh(cursor, shared))
+				return false;
+			world->addMesh(surf, shared);
+		}
+		else if (strcmp(keyword, "instance") == 0) {
+			std::shared_ptr<const TriangleMesh> shared;
+			Transform<float> placement;
+			if (!surface(cursor, surf) || !mesh(cursor, shared) || !transform(cursor, placement))
+				return false;
+			world->addInstance(surf, shared, placement);
+		}
+		else if (strcmp(keyword, "surface") == 0) {
+			if (!defineSurface(cursor))
+				return false;
+		}
+		else if (strcmp(keyword, "light") == 0) {
+			if (!numbers(cursor, v, 6))
+				return false;
+			world->addLight(new Light(Color(v[0], v[1], v[2]), Vec3<float>(v[3], v[4], v[5])));
+		}
+		else if (strcmp(keyword, "camera") == 0) {
+			if (!numbers(cursor, v, 6))
+				return false;
+			hasCamera = true;
+			cameraOrigin = Vec3<float>(v[0], v[1], v[2]);
+			cameraHorizontal = v[3];
+			cameraVertical = v[4];
+			cameraViewPort = v[5];
+		}
+		else {
+			return fail(std::string("unknown statement ") + keyword);
+		}
+
+		char * rest = word(cursor);
+		if (rest && rest[0] != '#')
+			return fail(std::string("unexpected ") + rest);
+		return true;
+	}
+
+public:
+	SceneLoader() : world(NULL), lastSurface(NULL), hasCamera(false) {}
+
+	// The scene in path seen through a width x height camera, with the
+	// world built. NULL if it cannot be read, see getError().
+	Scene * load(const std::string & path, int width, int height) {
+
+		if (!reader.open(path)) {
+			error = path + ": cannot open";
+			return NULL;
+		}
+
+		size_t slash = path.rfind('/');
+		directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+		surfaces.clear();
+		meshes.clear();
+		lastSurface = NULL;
+
+		hasCamera = false;
+
+		world = new World();
+		char * text;
+		bool ok = true;
+		while (ok && reader.next(text))
+			ok = statement(text);
+
+		reader.close();
+		meshes.clear();
+
+		if (!ok) {
+			error = path + error;
+			delete world;
+			return NULL;
+		}
+
+		world->build();
+		Camera * camera = hasCamera ? new Cam_Std(width, height, cameraOrigin, cameraHorizontal, cameraVertical, cameraViewPort)
+			: defaultCamera(width, height);
+		return new Scene(world, camera);
+	}
+
+	const std::string & getError() const { return error; }
+};
+
+// Loads the scene file or snapshot in path, or the demo scene if path is
+// empty. Prints why and returns NULL if the file cannot be read.
+inline Scene * loadScene(const std::string & path, int width, int height) {
+
+	if (path.empty())
+		return defaultScene(width, height);
+
+	if (isSnapshot(path)) {
+		std::string error;
+		Scene * scene = SnapshotReader().read(path, width, height, error);
+		if (!scene)
+			fprintf(stderr, "%s\n", error.c_str());
+		return scene;
+	}
+
+	SceneLoader loader;
+	Scene * scene = loader.load(path, width, height);
+	if (!scene)
+		fprintf(stderr, "%s\n", loader.getError().c_str());
+	return scene;
+}
+
+#endif
@@ -1,8 +1,17 @@
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #include "handler.hpp"
+#include "loader.hpp"
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <chrono>
+#include <thread>
 
 Handler handler;
+bool statsInTitle = false;
 int mouseLastX = 0;
 int mouseLastY = 0;
 bool mouseOn = false;
@@ -13,15 +22,68 @@ void draw(void) {
 }
 
 void idle() {
+    handler.settle();
+
     if (handler.drawmode->finished()) {
-        glutIdleFunc(NULL);
+        // keep watching for the input to settle, without spinning
+        if (handler.isMoving())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else
+            glutIdleFunc(NULL);
         return;
     }
-    
-    for (int i = 0; i < handler.getBatchSize(); i++)
-        if (!handler.drawmode->finished())
-            handler.drawmode->drawNext();
 
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int count = handler.drawmode->drawBatch(handler.scheduler.nextBatch());
+    // the cost of an item leaves out the wait for the first one
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    handler.scheduler.record(count, std::max(0.0, seconds - handler.drawmode->waitedSeconds()));
+
+    FrameStats stats;
+    if (handler.drawmode->takeFrameStats(stats)) {
+        handler.scheduler.report(stats);
+        printf("%s\n", stats.json().c_str());
+        fflush(stdout);
+        if (statsInTitle)
+            glutSetWindowTitle(stats.summary().c_str());
+    }
+}
+
+// Edits of the scene that keep the camera, shown by shading the last frame
+// again: l moves the first light, c cycles its color and m toggles the
+// mirror of the surface of the third object, the big blue sphere of the
+// demo scene. Each edit publishes a new version of the world, frames in
+// flight finish on the one they started with.
+bool editScene(unsigned char key) {
+
+    static const Color colors[] = { Color(1.0f, 1.0f, 1.0f), Color(1.0f, 0.8f, 0.6f), Color(0.6f, 0.8f, 1.0f) };
+    static int color = 0;
+    static bool mirror = true;
+
+    if (key != 108 && key != 99 && key != 109)
+        return false;
+    std::shared_ptr<const World> current = handler.versions->pin();
+    if (current->lights.empty() || current->objectCount() < 3)
+        return false;
+
+    if (key == 109)
+        mirror = !mirror;
+    else if (key == 99)
+        color = (color + 1) % 3;
+
+    handler.edit([key](World & world) {
+        Light * light = world.lights[0];
+        if (key == 108)
+            world.setLight(0, new Light(light->color, light->origin + Vec3<float>(10.0f, 0.0f, 0.0f)));
+        else if (key == 99)
+            world.setLight(0, new Light(colors[color], light->origin));
+        else {
+            Surface * surface = world.getSurface(2)->clone();
+            surface->setMirror(mirror ? 0.3f : 0.0f);
+            world.setSurface(2, surface);
+        }
+    }, key == 108 ? EDIT_LIGHTS : EDIT_SHADING);
+    return true;
 }
 
 void handleKeypress(unsigned char key, int x, int y) {
@@ -48,12 +110,16 @@ void handleKeypress(unsigned char key, int x, int y) {
     if (!handler.camera || !handler.drawmode)
         return;
 
+    if (editScene(key)) {
+        glutIdleFunc(idle);
+        return;
+    }
+
     if (dx != 0.0f || dz != 0.0f) {
 
-        handler.drawmode->setFinishedState(false);
         glutIdleFunc(idle);
         handler.camera->updateOrigin(Vec3<float>(dx, 0.0f, dz));
-        handler.drawmode->updateWindowContent();
+        handler.moved();
     }
 }
 
@@ -75,10 +141,9 @@ void passiveMouse(int x, int y) {
 
     if (dx != 0.0f || dy != 0.0f) {
 
-        handler.drawmode->setFinishedState(false);
         glutIdleFunc(idle);
         handler.camera->updateRotation(dy, dx);
-        handler.drawmode->updateWindowContent();
+        handler.moved();
     }
 
     mouseLastX = x;
@@ -96,7 +161,7 @@ void handleResize(int w,int h) {
 void update(int value) {
 
     glutPostRedisplay();
-    glutTimerFunc(50, update, 0);
+    glutTimerFunc(handler.scheduler.latencyMs(), update, 0);
 }
 
 //Main program
@@ -105,6 +170,56 @@ int main(int argc, char **argv) {
 
     glutInit(&argc, argv);
 
+    // raytracer [options] [scene] shows the scene file, by default the demo
+    // scene. --stats-title shows a summary of the last frame in the window
+    // title, --float-framebuffer keeps the displayed image in floats instead
+    // of sRGB8, --budget-ms is the time one idle call may take, --latency-ms
+    // the interval of the display refresh, --motion-rays the rays per
+    // frame while moving, --settle-ms the pause after which full refinement
+    // resumes and --min-throughput the share of a pixel below which mirror
+    // reflections are left out, or with --roulette decided by chance
+    std::string scenePath;
+    bool floatFramebuffer = false;
+    float minThroughput = 0.0f;
+    bool roulette = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats-title") == 0)
+            statsInTitle = true;
+        else if (strcmp(argv[i], "--float-framebuffer") == 0)
+            floatFramebuffer = true;
+        else if (strcmp(argv[i], "--budget-ms") == 0 && i + 1 < argc)
+            handler.scheduler.setBudget(atof(argv[++i]) / 1000.0);
+        else if (strcmp(argv[i], "--latency-ms") == 0 && i + 1 < argc)
+            handler.scheduler.setLatency(atof(argv[++i]) / 1000.0);
+        else if (strcmp(argv[i], "--motion-rays") == 0 && i + 1 < argc) {
+            int rays = atoi(argv[++i]);
+            if (rays <= 0) {
+                fprintf(stderr, "--motion-rays needs a positive number, not %s\n", argv[i]);
+                return 1;
+            }
+            handler.setMotionRays(rays);
+        }
+        else if (strcmp(argv[i], "--settle-ms") == 0 && i + 1 < argc)
+            handler.setMotionSettle(atof(argv[++i]) / 1000.0);
+        else if (strcmp(argv[i], "--min-throughput") == 0 && i + 1 < argc)
+            minThroughput = atof(argv[++i]);
+        else if (strcmp(argv[i], "--roulette") == 0)
+            roulette = true;
+        else if (argv[i][0] != '-')
+            scenePath = argv[i];
+    }
+
+    if (!scenePath.empty()) {
+        Scene * scene = loadScene(scenePath, handler.getWindowWidth(), handler.getWindowHeight());
+        if (!scene)
+            return 1;
+        handler.setScene(scene);
+    }
+    if (floatFramebuffer)
+        handler.drawmode->setFramebufferFormat(FB_FLOAT);
+    handler.versions->edit([&](World & world) { world.setTermination(minThroughput, roulette); });
+
     /*Setting up  The Display
     /    -RGB color model + Alpha Channel = GLUT_RGBA
     */
@@ -124,7 +239,7 @@ int main(int argc, char **argv) {
     glutKeyboardFunc(handleKeypress);
     glutPassiveMotionFunc(passiveMouse);
     glutReshapeFunc(handleResize);
-    glutTimerFunc(50, update, 0);
+    glutTimerFunc(handler.scheduler.latencyMs(), update, 0);
     glutIdleFunc(idle);
     handler.glInit();
 
@@ -0,0 +1,299 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "vec3.hpp"
+#include "ray.hpp"
+#include "bvh.hpp"
+
+// Triangles sharing one vertex array, e.g. an imported OBJ model. A triangle
+// is three indices into the vertices, so a vertex costs its 12 bytes once
+// however many triangles meet there. The mesh has a BVH of its own, the
+// World traverses it once a ray reaches the bounds of the mesh.
+class TriangleMesh
+{
+private:
+	std::vector<float> vertices;	// x, y, z per vertex
+	std::vector<int> indices;	// three per triangle, in BVH leaf order
+	BVH bvh;
+	AABB box;
+
+	const float * vertex(int triangle, int corner) const {
+		return &vertices[3 * indices[3 * triangle + corner]];
+	}
+
+public:
+	// A ray prepared for the watertight test of Woop, Benthin and Wald: the
+	// axis the ray runs along most becomes z and the triangles are sheared
+	// onto the ray, so a ray through an edge or a vertex shared by several
+	// triangles hits at least one of them.
+	struct MeshRay
+	{
+		BVHRay box;
+		float origin[3];
+		int kx, ky, kz;
+		float sx, sy, sz;
+
+		// The direction need not be normalised, distances are measured in
+		// its length.
+		MeshRay(const Vec3<float> & _origin, const Vec3<float> & direction) : box(_origin, direction) {
+
+			float dir[3] = { direction.getX(), direction.getY(), direction.getZ() };
+			origin[0] = _origin.getX();
+			origin[1] = _origin.getY();
+			origin[2] = _origin.getZ();
+
+			kz = 0;
+			if (fabs(dir[1]) > fabs(dir[kz]))
+				kz = 1;
+			if (fabs(dir[2]) > fabs(dir[kz]))
+				kz = 2;
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+			// keeps the winding, so the sign of the determinant tells the side
+			if (dir[kz] < 0.0f)
+				std::swap(kx, ky);
+
+			sx = dir[kx] / dir[kz];
+			sy = dir[ky] / dir[kz];
+			sz = 1.0f / dir[kz];
+		}
+	};
+
+	// Takes over the contents of both vectors and builds the hierarchy.
+	// Every index has to lie within the vertices. Leaves of up to four
+	// triangles take a third less memory than single ones at the same speed.
+	TriangleMesh(std::vector<float> & _vertices, std::vector<int> & _indices) : bvh(4, 4) {
+
+		vertices.swap(_vertices);
+		indices.swap(_indices);
+		vertices.shrink_to_fit();
+		indices.shrink_to_fit();
+
+		int count = triangleCount();
+		std::vector<AABB> boxes(count);
+		std::vector<int> ids(count);
+		for (int i = 0; i < count; i++) {
+			for (int c = 0; c < 3; c++) {
+				const float * p = vertex(i, c);
+				boxes[i].extend(Vec3<float>(p[0], p[1], p[2]));
+			}
+			box.extend(boxes[i]);
+			ids[i] = i;
+		}
+		bvh.build(boxes, ids);
+
+		// the leaves address the triangles directly from here on
+		std::vector<int> sorted(indices.size());
+		for (int i = 0; i < count; i++)
+			std::copy(&indices[3 * bvh.indices[i]], &indices[3 * bvh.indices[i]] + 3, &sorted[3 * i]);
+		indices.swap(sorted);
+		bvh.indices.clear();
+	}
+
+	int vertexCount() const { return vertices.size() / 3; }
+	int triangleCount() const { return indices.size() / 3; }
+	const AABB & bounds() const { return box; }
+
+	// The bounds of the mesh placed by transform.
+	AABB bounds(const Transform<float> & transform) const {
+
+		AABB result;
+		for (int i = 0; i < 8; i++)
+			result.extend(transform.point(Vec3<float>(
+				i & 1 ? box.upper.getX() : box.lower.getX(),
+				i & 2 ? box.upper.getY() : box.lower.getY(),
+				i & 4 ? box.upper.getZ() : box.lower.getZ())));
+		return result;
+	}
+
+	// Bytes held by the vertices, the indices and the hierarchy.
+	size_t memory() const {
+		return vertices.capacity() * sizeof(float) + indices.capacity() * sizeof(int)
+			+ bvh.nodes.size() * sizeof(BVHNode);
+	}
+
+	// Distance along the ray to the triangle, negative or NaN if missed.
+	float intersect(const MeshRay & r, int triangle) const {
+
+		const float * p0 = vertex(triangle, 0);
+		const float * p1 = vertex(triangle, 1);
+		const float * p2 = vertex(triangle, 2);
+
+		float az = p0[r.kz] - r.origin[r.kz];
+		float bz = p1[r.kz] - r.origin[r.kz];
+		float cz = p2[r.kz] - r.origin[r.kz];
+		float ax = p0[r.kx] - r.origin[r.kx] - r.sx * az;
+		float ay = p0[r.ky] - r.origin[r.ky] - r.sy * az;
+		float bx = p1[r.kx] - r.origin[r.kx] - r.sx * bz;
+		float by = p1[r.ky] - r.origin[r.ky] - r.sy * bz;
+		float cx = p2[r.kx] - r.origin[r.kx] - r.sx * cz;
+		float cy = p2[r.ky] - r.origin[r.ky] - r.sy * cz;
+
+		// scaled barycentric coordinates
+		float u = cx * by - cy * bx;
+		float v = ax * cy - ay * cx;
+		float w = bx * ay - by * ax;
+
+		// on an edge in float, double tells the side
+		if (u == 0.0f || v == 0.0f || w == 0.0f) {
+			u = (float)((double)cx * by - (double)cy * bx);
+			v = (float)((double)ax * cy - (double)ay * cx);
+			w = (float)((double)bx * ay - (double)by * ax);
+		}
+
+		if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+			return -1.0f;
+
+		float det = u + v + w;
+		if (det == 0.0f)
+			return -1.0f;
+
+		return (u * az + v * bz + w * cz) * r.sz / det;
+	}
+
+	// Helper handed to BVH::traverse, keeps the closest triangle.
+	struct Closest
+	{
+		const TriangleMesh * mesh;
+		const MeshRay * ray;
+		float tMin;
+		int triangle;
+		unsigned long tests;
+
+		Closest(const TriangleMesh * _mesh, const MeshRay & _ray, float _tMin)
+		: mesh(_mesh), ray(&_ray), tMin(_tMin), triangle(-1), tests(0) {}
+
+		bool operator()(int start, int count, float & tMax) {
+
+			tests += count;
+			for (int i = start; i < start + count; i++) {
+				float t = mesh->intersect(*ray, i);
+				if (t > tMin && t < tMax) {
+					tMax = t;
+					triangle = i;
+				}
+			}
+			return false;
+		}
+	};
+
+	// Helper handed to BVH::traverse, stops at the first triangle.
+	struct Any
+	{
+		const TriangleMesh * mesh;
+		const MeshRay * ray;
+		float tMin;
+		bool found;
+		unsigned long tests;
+
+		Any(const TriangleMesh * _mesh, const MeshRay & _ray, float _tMin)
+		: mesh(_mesh), ray(&_ray), tMin(_tMin), found(false), tests(0) {}
+
+		bool operator()(int start, int count, float & tMax) {
+
+			for (int i = start; i < start + count && !found; i++) {
+				tests++;
+				float t = mesh->intersect(*ray, i);
+				found = t > tMin && t < tMax;
+			}
+			return found;
+		}
+	};
+
+	// The closest triangle hit between tMin and tMax, which shrinks to its
+	// distance, or -1. tests counts the triangles tested.
+	int closest(const MeshRay & r, float tMin, float & tMax, unsigned long & tests) const {
+
+		Closest visit(this, r, tMin);
+		bvh.traverse(r.box, tMax, visit);
+		tests += visit.tests;
+		return visit.triangle;
+	}
+
+	// Whether any triangle is hit between tMin and tMax.
+	bool any(const MeshRay & r, float tMin, float tMax, unsigned long & tests) const {
+
+		Any visit(this, r, tMin);
+		bvh.traverse(r.box, tMax, visit);
+		tests += visit.tests;
+		return visit.found;
+	}
+
+	// The normal of the triangle, on the side its corners run counter
+	// clockwise as in OBJ files.
+	Vec3<float> normal(int triangle) const {
+
+		const float * p0 = vertex(triangle, 0);
+		const float * p1 = vertex(triangle, 1);
+		const float * p2 = vertex(triangle, 2);
+		Vec3<float> a(p0[0], p0[1], p0[2]);
+		Vec3<float> b(p1[0], p1[1], p1[2]);
+		Vec3<float> c(p2[0], p2[1], p2[2]);
+		return Vec3<float>::crossProduct(b - a, c - a).normalise();
+	}
+
+	// The triangle a point on the mesh lies on, for callers that only know
+	// the point. Tracing keeps the triangle it hit instead.
+	int nearest(const Vec3<float> & point) const {
+
+		if (bvh.empty())
+			return -1;
+
+		float p[3] = { point.getX(), point.getY(), point.getZ() };
+		float tolerance = 1e-4f * (box.upper - box.lower).length();
+
+		int best = -1;
+		bool bestInside = false;
+		float bestDist = std::numeric_limits<float>::infinity();
+
+		std::vector<int> stack(1, 0);
+		while (!stack.empty()) {
+
+			const BVHNode & node = bvh.nodes[stack.back()];
+			stack.pop_back();
+
+			bool contains = true;
+			for (int a = 0; a < 3; a++)
+				contains = contains && p[a] >= node.lower[a] - tolerance && p[a] <= node.upper[a] + tolerance;
+			if (!contains)
+				continue;
+
+			if (!node.leaf()) {
+				stack.push_back(node.start);
+				stack.push_back(node.start + 1);
+				continue;
+			}
+
+			for (int i = node.start; i < node.start + node.count; i++) {
+
+				const float * p0 = vertex(i, 0);
+				Vec3<float> n = normal(i);
+				Vec3<float> d = point - Vec3<float>(p0[0], p0[1], p0[2]);
+				float dist = fabs(n.dotProduct(d));
+
+				// inside if the point lies on the inner side of all edges
+				bool inside = true;
+				for (int c = 0; c < 3; c++) {
+					const float * e0 = vertex(i, c);
+					const float * e1 = vertex(i, (c + 1) % 3);
+					Vec3<float> edge(e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2]);
+					Vec3<float> toPoint(p[0] - e0[0], p[1] - e0[1], p[2] - e0[2]);
+					inside = inside && Vec3<float>::crossProduct(edge, toPoint).dotProduct(n) >= -tolerance * edge.length();
+				}
+
+				if ((inside && !bestInside) || (inside == bestInside && dist < bestDist)) {
+					best = i;
+					bestInside = inside;
+					bestDist = dist;
+				}
+			}
+		}
+		return best;
+	}
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "scene.hpp"
+#include "loader.hpp"
+#include "renderer.hpp"
+#include <cstdio>
+
+// Checks the frames shown while the camera moves, at the viewer's defaults:
+// a 1024x1024 window and TileRenderer::defaultMotionRays.
+//
+//   raytracer_motion_test
+//
+// Exits with 1 if any check fails.
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char * what) {
+
+    printf("%s  %s\n", condition ? "ok    " : "FAILED", what);
+    if (!condition)
+        failures++;
+}
+
+void finish(TileRenderer & renderer) {
+
+    while (!renderer.finished())
+        delete renderer.next(100);
+}
+
+bool powerOfTwo(int step) {
+    return step > 0 && (step & (step - 1)) == 0;
+}
+
+}
+
+int main() {
+
+    const int width = 1024;
+    const int height = 1024;
+    const long rays = TileRenderer::defaultMotionRays;
+
+    Scene * scene = loadScene("", width, height);
+    TileRenderer renderer(scene->world.get(), ThreadPool::hardwareThreads());
+
+    // no complete frame yet, the motion frame is traced
+    bool reprojected;
+    RenderStats before = RenderStats::snapshot();
+    int step = renderer.startMotion(scene->camera, width, height, rays, reprojected);
+    finish(renderer);
+    RenderStats traced = RenderStats::snapshot() - before;
+
+    check(!reprojected, "without a complete frame the motion frame is traced");
+    check(powerOfTwo(step), "the traced motion step is a power of two");
+    check(traced.rays() <= rays, "the traced motion frame stays within the ray budget");
+
+    renderer.start(scene->camera, width, height);
+    finish(renderer);
+
+    // a small turn, as two pixels of mouse movement give
+    Camera * turned = scene->camera->clone();
+    turned->updateRotation(0.02f, 0.0f);
+
+    before = RenderStats::snapshot();
+    int seededStep = renderer.startMotion(turned, width, height, rays, reprojected);
+    finish(renderer);
+    RenderStats seeded = RenderStats::snapshot() - before;
+
+    check(reprojected, "after a complete frame the motion frame is reprojected");
+    check(powerOfTwo(seededStep) && seededStep <= step, "the reprojected step is a power of two no coarser than the traced one");
+    check(seeded[STAT_REPROJECTED_PIXELS] > 0, "the reprojected motion frame reuses samples");
+    check(seeded.rays() <= rays, "the reprojected motion frame stays within the ray budget");
+
+    printf("traced step %d, %lu rays; reprojected step %d, %lu rays; budget %ld\n",
+        step, traced.rays(), seededStep, seeded.rays(), rays);
+
+    delete turned;
+    delete scene;
+    return failures ? 1 : 0;
+}
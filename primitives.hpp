@@ -0,0 +1,206 @@
+#ifndef PRIMITIVES_HPP
+#define PRIMITIVES_HPP
+
+#include <vector>
+#include "vec3.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+#include "table.hpp"
+
+class WorldObject;
+class TriangleMesh;
+
+enum PrimitiveType
+{
+	PRIM_SPHERE,
+	PRIM_PLANE,
+	PRIM_MESH,	// a TriangleMesh, traced through its own BVH
+	PRIM_INSTANCE,	// a TriangleMesh placed by a transform
+	PRIM_OBJECT	// any other WorldObject, only reachable through its virtual interface
+};
+
+// The objects of a World compiled into flat arrays, one per primitive type.
+// Intersecting a primitive or taking its normal is a switch over its type
+// on data lying next to that of its neighbours, instead of a virtual call
+// into an object somewhere on the heap. Objects are identified by the index
+// they were added at, their geometry by a slot in the array of their type.
+class PrimitiveStore
+{
+public:
+	struct Ref
+	{
+		PrimitiveType type;
+		int slot;
+		int material;	// index into the material table of the World
+	};
+
+	struct Sphere
+	{
+		Vec3<float> center;
+		float radius;
+	};
+
+	struct Plane
+	{
+		Vec3<float> point;
+		Vec3<float> normal;
+	};
+
+	struct Instance
+	{
+		const TriangleMesh * mesh;
+		Transform<float> toMesh;	// from world to mesh space
+	};
+
+private:
+	Table<Ref> refs;
+	Table<Sphere> spheres;
+	Table<Plane> planes;
+	std::vector<const TriangleMesh*> meshes;
+	Table<Instance> instances;
+	std::vector<WorldObject*> others;
+
+	int add(PrimitiveType type, int slot) {
+
+		Ref ref = { type, slot, -1 };
+		refs.push_back(ref);
+		return (int)refs.size() - 1;
+	}
+
+public:
+	int size() const { return (int)refs.size(); }
+
+	int sphereCount() const { return (int)spheres.size(); }
+	int meshCount() const { return (int)meshes.size(); }
+	int instanceCount() const { return (int)instances.size(); }
+	int objectCount() const { return (int)others.size(); }
+
+	int addSphere(const Vec3<float> & center, float radius) {
+
+		Sphere sphere = { center, radius };
+		spheres.push_back(sphere);
+		return add(PRIM_SPHERE, (int)spheres.size() - 1);
+	}
+
+	int addPlane(const Vec3<float> & point, const Vec3<float> & normal) {
+
+		Plane plane = { point, normal };
+		planes.push_back(plane);
+		return add(PRIM_PLANE, (int)planes.size() - 1);
+	}
+
+	// The mesh is not owned and may be added any number of times.
+	int addMesh(const TriangleMesh * mesh) {
+
+		meshes.push_back(mesh);
+		return add(PRIM_MESH, (int)meshes.size() - 1);
+	}
+
+	int addInstance(const TriangleMesh * mesh, const Transform<float> & toMesh) {
+
+		Instance instance = { mesh, toMesh };
+		instances.push_back(instance);
+		return add(PRIM_INSTANCE, (int)instances.size() - 1);
+	}
+
+	int addObject(WorldObject * object) {
+
+		others.push_back(object);
+		return add(PRIM_OBJECT, (int)others.size() - 1);
+	}
+
+	PrimitiveType type(int id) const { return refs[id].type; }
+	int material(int id) const { return refs[id].material; }
+	void setMaterial(int id, int material) { refs[id].material = material; }
+	const Sphere & sphere(int id) const { return spheres[refs[id].slot]; }
+	const Plane & plane(int id) const { return planes[refs[id].slot]; }
+	// Meshes and instances both consist of the triangles of a mesh.
+	bool isMesh(int id) const { return refs[id].type == PRIM_MESH || refs[id].type == PRIM_INSTANCE; }
+	const TriangleMesh * mesh(int id) const {
+		return refs[id].type == PRIM_INSTANCE ? instances[refs[id].slot].mesh : meshes[refs[id].slot];
+	}
+	const Instance & instance(int id) const { return instances[refs[id].slot]; }
+
+	// Returns false, changing nothing, if id is no sphere.
+	bool setSphere(int id, const Vec3<float> & center, float radius) {
+
+		if (id < 0 || id >= size() || refs[id].type != PRIM_SPHERE)
+			return false;
+		Sphere sphere = { center, radius };
+		spheres[refs[id].slot] = sphere;
+		return true;
+	}
+
+	// Places mesh or instance id by toMesh. A mesh becomes an instance of
+	// its triangles. Returns false, changing nothing, if id is neither.
+	bool setInstance(int id, const Transform<float> & toMesh) {
+
+		if (id < 0 || id >= size() || !isMesh(id))
+			return false;
+		Ref & ref = refs[id];
+		if (ref.type == PRIM_MESH) {
+			Instance instance = { meshes[ref.slot], toMesh };
+			instances.push_back(instance);
+			ref.type = PRIM_INSTANCE;
+			ref.slot = (int)instances.size() - 1;
+		}
+		else {
+			instances[ref.slot].toMesh = toMesh;
+		}
+		return true;
+	}
+	WorldObject * object(int id) const { return others[refs[id].slot]; }
+
+	// Meshes, instances and the objects of other types are not part of the
+	// tables.
+	template <class Visitor> void visitTables(Visitor & visit) {
+		visit(refs);
+		visit(spheres);
+		visit(planes);
+	}
+
+	// Whether the tables, e.g. read from a file, hold only spheres and
+	// planes, each within its array and with a material below
+	// materialCount.
+	bool valid(int materialCount) const {
+
+		for (size_t i = 0; i < refs.size(); i++) {
+			const Ref & ref = refs[i];
+			size_t slots = ref.type == PRIM_SPHERE ? spheres.size() : ref.type == PRIM_PLANE ? planes.size() : 0;
+			if (ref.slot < 0 || (size_t)ref.slot >= slots || ref.material < 0 || ref.material >= materialCount)
+				return false;
+		}
+		return true;
+	}
+
+	// Same results as the distance of the WorldObject, -1 for meshes,
+	// instances and PRIM_OBJECT.
+	float distance(int id, const SimdRay & r) const {
+
+		const Ref & ref = refs[id];
+		switch (ref.type) {
+		case PRIM_SPHERE: {
+			const Sphere & s = spheres[ref.slot];
+			return intersectSphere(r, s.center.getX(), s.center.getY(), s.center.getZ(), s.radius * s.radius);
+		}
+		case PRIM_PLANE: {
+			const Plane & p = planes[ref.slot];
+			return intersectPlane(r, p.point.getX(), p.point.getY(), p.point.getZ(),
+				p.normal.getX(), p.normal.getY(), p.normal.getZ());
+		}
+		default:
+			return -1.0f;
+		}
+	}
+
+	// Only for spheres and planes.
+	Vec3<float> normal(int id, const Vec3<float> & point) const {
+
+		const Ref & ref = refs[id];
+		if (ref.type == PRIM_SPHERE)
+			return (point - spheres[ref.slot].center).normalise();
+		return planes[ref.slot].normal;
+	}
+};
+
+#endif
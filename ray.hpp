@@ -2,6 +2,8 @@
 #define RAY_HPP
 
 #include <cmath>
+#include <typeinfo>
+#include <atomic>
 #include "vec3.hpp"
 #include "world.hpp"
 
@@ -46,7 +48,61 @@ public:
 	}
 };
 
-class Surface
+// Which shading kernel a Material takes, see World::shadeSurface.
+enum MaterialFeature
+{
+	MAT_MIRROR = 1,	// reflects part of the light
+	MAT_PATTERN = 2,	// colored like S_Pattern
+	MAT_SMALL_EXPONENT = 4,	// phong exponent in [0, 64], raised by multiplying
+	MAT_VIRTUAL = 8	// a Surface subclass only its virtual getters describe
+};
+
+// A Surface flattened into plain data, so shading needs no virtual call.
+struct Material
+{
+	Color color;
+	float ambient;
+	float diffuse;
+	float specular;
+	float mirror;
+	int phong;
+	unsigned features;
+};
+
+inline Color patternColor(const Color & color, const Vec3<float> & point) {
+
+	float modx = fmod(fabs(point.getX()), M_PI);
+	float modz = fmod(fabs(point.getZ()), M_PI);
+
+	return Color(
+		color.r * sin(modx) * sin(modz), 
+		color.g * sin(modx) * sin(modz), 
+		color.b * sin(modx) * sin(modz));
+}
+
+// Counts the owners of an object shared between them, the last to release
+// it deletes it. A copy starts without owners.
+class Shared
+{
+private:
+	mutable std::atomic<int> owners;
+
+public:
+	Shared() : owners(0) {}
+	Shared(const Shared & other) : owners(0) {}
+	Shared & operator=(const Shared & other) { return *this; }
+	virtual ~Shared() {}
+
+	void retain() const { owners++; }
+	void release() const {
+		if (--owners == 0)
+			delete this;
+	}
+};
+
+// Owned through retain() and release(): every WorldObject and World using a
+// surface holds it, so one surface may color any number of objects.
+class Surface : public Shared
 {
 protected:
 	Color color;
@@ -71,6 +127,8 @@ public:
 		mirrorCoef = 0.0f;
 	}
 	virtual ~Surface() {};
+	// A copy without owners, to change in place of this one.
+	virtual Surface * clone() const { return new Surface(*this); }
 	virtual void setColor(float r, float g, float b) {
 		color = Color(r, g, b);
 	}
@@ -107,6 +165,26 @@ public:
 	virtual float getMirror(const Vec3<float> & point) const {
 		return mirrorCoef;
 	}
+
+	// Fills in the material. Subclasses that do not flatten themselves are
+	// marked MAT_VIRTUAL and shaded through the getters above.
+	virtual void flatten(Material & material) const {
+
+		material.color = color;
+		material.ambient = getAmbient();
+		material.diffuse = getDiffuse();
+		material.specular = getSpecular();
+		material.mirror = mirrorCoef;
+		material.phong = getPhongModel();
+
+		material.features = 0;
+		if (mirrorCoef != 0.0f)
+			material.features |= MAT_MIRROR;
+		if (material.phong >= 0 && material.phong <= 64)
+			material.features |= MAT_SMALL_EXPONENT;
+		if (typeid(*this) != typeid(Surface))
+			material.features |= MAT_VIRTUAL;
+	}
 };
 
 class S_Pattern : public Surface
@@ -115,16 +193,19 @@ public:
 	S_Pattern() : Surface() {
 		
 	}
+	virtual Surface * clone() const { return new S_Pattern(*this); }
 
 	virtual Color getColor(const Vec3<float> & point) const {
 
-		float modx = fmod(fabs(point.getX()), M_PI);
-		float modz = fmod(fabs(point.getZ()), M_PI);
+		return patternColor(color, point);
+	}
+
+	virtual void flatten(Material & material) const {
 
-		return Color(
-			color.r * sin(modx) * sin(modz), 
-			color.g * sin(modx) * sin(modz), 
-			color.b * sin(modx) * sin(modz));
+		Surface::flatten(material);
+		material.features |= MAT_PATTERN;
+		if (typeid(*this) == typeid(S_Pattern))
+			material.features &= ~MAT_VIRTUAL;
 	}
 };
 
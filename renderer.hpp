@@ -0,0 +1,613 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include "world.hpp"
+#include "versions.hpp"
+#include "threadpool.hpp"
+
+// A block of samples of one refinement level. Sample (i, j) lies at pixel
+// (left + i * step, bottom + j * step) and stands for the step x step pixels
+// above and right of it until a finer level replaces them. Except on the
+// coarsest level, samples on the grid of the previous level (both sample
+// coordinates of the level even) were traced there already and are skipped.
+// The parity is that of the level's coordinate rather than of i and j, so
+// it holds whatever the tile size.
+class Tile
+{
+public:
+	int left;
+	int bottom;
+	int width;
+	int height;
+	int step;
+	int level;
+
+	std::vector<Color> pixels;
+
+	Tile(int _left, int _bottom, int _width, int _height, int _step, int _level)
+	: left(_left), bottom(_bottom), width(_width), height(_height)
+	, step(_step), level(_level), pixels(_width * _height) {
+
+	}
+
+	bool traced(int i, int j) const {
+		return level == 0 || ((left / step + i) & 1) || ((bottom / step + j) & 1);
+	}
+};
+
+// Traces a frame on a thread pool, coarse to fine. Level 0 samples every
+// coarsestStep-th pixel, each further level halves the spacing and traces
+// only the new samples, so every pixel is traced exactly once. All levels
+// are queued at once, coarse ones first, and are traced in parallel.
+// The world is only ever read by the workers and the camera is copied at
+// the start of every frame, so the caller is free to move its own camera
+// while a frame is in flight. Given WorldVersions, every frame pins the
+// version current at its start, so edits may be published at any time and
+// show from the next frame on. Finished tiles are handed back through
+// next() in completion order.
+//
+// Full resolution frames leave a ShadingRecord per pixel behind. After a
+// camera move startReprojected() moves those hits into the samples of the
+// new view and only shades them again; primary and shadow rays are traced
+// just for the samples no old hit lands on, or whose hit may be hidden in
+// the new view.
+// A ray from the new camera to each reused hit finds those hidden behind
+// something else now.
+// Without a camera move startRelit() shades all of them again, so changes
+// of lights and surfaces show without tracing any primary ray.
+//
+// startMotion() picks the frame shown while the camera moves from a budget
+// of rays. The rays a sample casts are estimated from the counters of the
+// last frame that traced all of its samples.
+class TileRenderer
+{
+private:
+	enum { packetSize = 4, shadeBatch = 512 };
+
+	ThreadPool pool;
+	const WorldVersions * versions;
+	std::shared_ptr<const World> pinned;	// the version of the frame in flight
+	const World * world;
+	Camera * frameCamera;
+	int tileSize;
+
+	std::atomic<int> generation;
+	int inFlight;
+	int tilesTotal;
+	int tilesCollected;
+	std::vector<int> levelTiles;
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<Tile*> finishedTiles;
+
+	// Records of the frame in flight and of the last complete one, and
+	// for a reprojected frame the history record to reuse per pixel.
+	std::vector<ShadingRecord> records;
+	std::vector<ShadingRecord> history;
+	std::vector<int> seeds;
+	// Per pixel of the new view the nearest history hit projecting onto
+	// it, see nearestKey(), written by the jobs of projectHistory().
+	std::unique_ptr<std::atomic<uint64_t>[]> nearest;
+	int nearestSize;
+	static const uint64_t emptyKey = ~(uint64_t)0;	// its depth is a NaN, nearer than nothing
+	int frameWidth;
+	int historyWidth;
+	int historyHeight;
+	Camera * historyCamera;
+	bool recording;
+	bool reprojecting;
+	bool viewMoved;	// reused hits may be hidden behind something else now
+	bool relighting;
+	bool historyValid;
+	bool historyVisibility;	// the lit bits of history may be outdated
+
+	// Rays per traced sample, all of them and just the mirror reflections,
+	// measured when a frame without reused samples completes.
+	float tracedRays;
+	float mirrorRays;
+	bool measuring;
+	RenderStats frameCounters;
+
+	// Tiles are traced in blocks of packetSize x packetSize samples, the
+	// rays of a block that still need tracing lie next to each other so
+	// they form packets. Rows of blocks are shaded together once they hold
+	// shadeBatch rays, which gives the wavefront shading batches to work on.
+	void trace(Tile * tile, int gen) {
+
+		std::vector<Ray> rays;
+		std::vector<Ray> packet;
+		std::vector<int> slots;
+		std::vector<int> pixels;
+		std::vector<Color> colors;
+		std::vector<ShadingRecord> traced;
+		int reusedSlots[packetSize * packetSize];
+		int reusedPixels[packetSize * packetSize];
+		int reusedRays[packetSize * packetSize];
+		ShadingRecord reusedRecords[packetSize * packetSize];
+		Vec3<float> reusedPoints[packetSize * packetSize];
+		Vec3<float> origin = frameCamera->getOrigin();
+
+		for (int y = 0; y < tile->height && generation.load() == gen; y += packetSize) {
+
+			for (int x = 0; x < tile->width; x += packetSize) {
+
+				int w = std::min<int>(packetSize, tile->width - x);
+				int h = std::min<int>(packetSize, tile->height - y);
+
+				frameCamera->getRays(tile->left + x * tile->step, tile->bottom + y * tile->step, w, h, tile->step, rays);
+
+				int reused = 0;
+				for (int j = 0; j < h; j++) {
+					for (int i = 0; i < w; i++) {
+
+						if (!tile->traced(x + i, y + j))
+							continue;
+
+						int slot = (y + j) * tile->width + x + i;
+						int pixel = (tile->bottom + (y + j) * tile->step) * frameWidth + tile->left + (x + i) * tile->step;
+
+						if (reprojecting && seeds[pixel] >= 0) {
+							reusedSlots[reused] = slot;
+							reusedPixels[reused] = pixel;
+							reusedRays[reused] = j * w + i;
+							reusedRecords[reused++] = history[seeds[pixel]];
+							continue;
+						}
+
+						slots.push_back(slot);
+						pixels.push_back(pixel);
+						packet.push_back(rays[j * w + i]);
+					}
+				}
+
+				// an old hit that something now lies in front of, e.g. an
+				// object that came into view, is traced instead
+				if (viewMoved && reused > 0) {
+
+					for (int k = 0; k < reused; k++)
+						reusedPoints[k] = reusedRecords[k].point;
+					unsigned hidden = world->occludedPacket(origin, reusedPoints, reused, (1u << reused) - 1);
+
+					int kept = 0;
+					for (int k = 0; k < reused; k++) {
+						if ((hidden >> k) & 1) {
+							slots.push_back(reusedSlots[k]);
+							pixels.push_back(reusedPixels[k]);
+							packet.push_back(rays[reusedRays[k]]);
+							continue;
+						}
+						reusedSlots[kept] = reusedSlots[k];
+						reusedPixels[kept] = reusedPixels[k];
+						reusedRecords[kept++] = reusedRecords[k];
+					}
+					reused = kept;
+				}
+
+				if (relighting)
+					world->updateVisibility(reusedRecords, reused);
+
+				for (int k = 0; k < reused; k++) {
+					tile->pixels[reusedSlots[k]] = world->reshade(origin, reusedRecords[k]);
+					if (recording)
+						records[reusedPixels[k]] = reusedRecords[k];
+				}
+				countStat(STAT_REPROJECTED_PIXELS, reused);
+			}
+
+			if (packet.empty() || (packet.size() < shadeBatch && y + packetSize < tile->height))
+				continue;
+
+			colors.resize(packet.size());
+			if (recording)
+				traced.resize(packet.size());
+			world->getColors(&packet[0], packet.size(), &colors[0], recording ? &traced[0] : NULL);
+
+			for (int k = 0; k < packet.size(); k++) {
+				tile->pixels[slots[k]] = colors[k];
+				if (recording)
+					records[pixels[k]] = traced[k];
+			}
+
+			packet.clear();
+			slots.clear();
+			pixels.clear();
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (generation.load() == gen)
+			finishedTiles.push_back(tile);
+		else
+			delete tile;
+
+		inFlight--;
+		changed.notify_all();
+	}
+
+public:
+	// Pins the version current now for the next frame, no worker runs.
+	void pin() {
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (versions) {
+			pinned = versions->pin();
+			world = pinned.get();
+		}
+	}
+
+	// Queues the tiles of all levels, the caller holds no lock and no
+	// worker runs.
+	void submit(int width, int height, int coarsestStep, int finestStep) {
+
+		int gen = generation.load();
+		std::lock_guard<std::mutex> guard(lock);
+
+		tilesTotal = 0;
+		tilesCollected = 0;
+		levelTiles.clear();
+
+		frameWidth = width;
+		recording = finestStep == 1 && world->recordable();
+		if (recording)
+			records.resize(width * height);
+
+		for (int step = coarsestStep, level = 0; step >= finestStep; step /= 2, level++) {
+
+			// tiles cover tileSize x tileSize samples of this level
+			int columns = (width + step - 1) / step;
+			int rows = (height + step - 1) / step;
+			levelTiles.push_back(0);
+
+			for (int bottom = 0; bottom < rows; bottom += tileSize) {
+				for (int left = 0; left < columns; left += tileSize) {
+
+					Tile * tile = new Tile(left * step, bottom * step,
+						std::min(tileSize, columns - left),
+						std::min(tileSize, rows - bottom),
+						step, level);
+
+					levelTiles[level]++;
+					tilesTotal++;
+					inFlight++;
+					pool.submit(std::bind(&TileRenderer::trace, this, tile, gen));
+				}
+			}
+		}
+	}
+
+	// Depths are positive, so their bits order like them; with the history
+	// index below, the smallest key of a pixel is its nearest hit, the
+	// first one in history order among equally near ones.
+	static uint64_t nearestKey(float depth, int index) {
+
+		uint32_t bits;
+		memcpy(&bits, &depth, sizeof(bits));
+		return (uint64_t)bits << 32 | (uint32_t)index;
+	}
+	float nearestDepth(int pixel) const {
+
+		uint32_t bits = nearest[pixel].load(std::memory_order_relaxed) >> 32;
+		float depth;
+		memcpy(&depth, &bits, sizeof(depth));
+		return depth;
+	}
+
+	// Projects the history hits from begin to end into the view of
+	// frameCamera, one job of projectHistory().
+	void projectRange(int begin, int end) {
+
+		for (int i = begin; i < end; i++) {
+
+			int x, y;
+			float d;
+			if (history[i].object == -1 || !frameCamera->project(history[i].point, x, y, d))
+				continue;
+
+			std::atomic<uint64_t> & slot = nearest[y * frameWidth + x];
+			uint64_t key = nearestKey(d, i);
+			uint64_t current = slot.load(std::memory_order_relaxed);
+			while (key < current && !slot.compare_exchange_weak(current, key, std::memory_order_relaxed))
+				;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		inFlight--;
+		changed.notify_all();
+	}
+
+	// Finds for every pixel of the new view the nearest history hit that
+	// projects onto it, in jobs on the pool; no worker runs before.
+	void projectHistory(int width, int height) {
+
+		if (nearestSize != width * height) {
+			nearestSize = width * height;
+			nearest.reset(new std::atomic<uint64_t>[nearestSize]);
+		}
+		for (int p = 0; p < nearestSize; p++)
+			nearest[p].store(emptyKey, std::memory_order_relaxed);
+
+		int count = history.size();
+		int chunk = std::max(4096, (count + pool.size() * 4 - 1) / (pool.size() * 4));
+		frameWidth = width;
+
+		std::unique_lock<std::mutex> guard(lock);
+		for (int begin = 0; begin < count; begin += chunk) {
+			inFlight++;
+			pool.submit(std::bind(&TileRenderer::projectRange, this, begin, std::min(count, begin + chunk)));
+		}
+		while (inFlight > 0)
+			changed.wait(guard);
+	}
+
+	// Seeds every step-th pixel with the nearest history hit projecting onto
+	// it, see projectHistory(). A pixel next to a clearly nearer one is
+	// traced instead, its hit may show through a gap in the nearer surface
+	// that the old view did not cover. Returns the number of samples left
+	// without a seed.
+	long seed(int width, int height, int step) {
+
+		long unseeded = 0;
+		seeds.assign(width * height, -1);
+		for (int y = 0; y < height; y += step) {
+			for (int x = 0; x < width; x += step) {
+
+				int p = y * width + x;
+				uint64_t key = nearest[p].load(std::memory_order_relaxed);
+				if (key == emptyKey) {
+					unseeded++;
+					continue;
+				}
+
+				float depth = nearestDepth(p);
+				bool covered = false;
+				for (int j = std::max(0, y - 1); j <= std::min(height - 1, y + 1) && !covered; j++)
+					for (int i = std::max(0, x - 1); i <= std::min(width - 1, x + 1) && !covered; i++)
+						covered = nearestDepth(j * width + i) < depth * 0.9f;
+
+				if (covered)
+					unseeded++;
+				else
+					seeds[p] = (uint32_t)key;
+			}
+		}
+		return unseeded;
+	}
+
+public:
+	TileRenderer(const World * _world, int threads, int _tileSize = 32)
+	: pool(threads), versions(NULL), world(_world), frameCamera(NULL), tileSize(_tileSize)
+	, generation(0), inFlight(0), tilesTotal(0), tilesCollected(0)
+	, frameWidth(0), historyWidth(0), historyHeight(0)
+	, historyCamera(NULL), recording(false), reprojecting(false), viewMoved(false), relighting(false), historyValid(false), historyVisibility(false)
+	, tracedRays(1.0f + world->lights.size()), mirrorRays(0.0f), measuring(false), nearestSize(0) {
+
+	}
+	TileRenderer(const WorldVersions * _versions, int threads, int _tileSize = 32)
+	: pool(threads), versions(_versions), pinned(_versions->pin()), world(pinned.get()), frameCamera(NULL), tileSize(_tileSize)
+	, generation(0), inFlight(0), tilesTotal(0), tilesCollected(0)
+	, frameWidth(0), historyWidth(0), historyHeight(0)
+	, historyCamera(NULL), recording(false), reprojecting(false), viewMoved(false), relighting(false), historyValid(false), historyVisibility(false)
+	, tracedRays(1.0f + world->lights.size()), mirrorRays(0.0f), measuring(false), nearestSize(0) {
+
+	}
+	~TileRenderer() {
+
+		cancel();
+		delete frameCamera;
+		delete historyCamera;
+	}
+
+	int threads() const { return pool.size(); }
+	bool finished() const { return tilesCollected == tilesTotal; }
+	int levels() const { return levelTiles.size(); }
+	int tilesInLevel(int level) const { return levelTiles[level]; }
+
+	// Levels run from coarsestStep down to finestStep, each half the one
+	// before, so their ratio has to be a power of two. Both 1 traces the
+	// frame in one level.
+	void start(const Camera * camera, int width, int height, int coarsestStep = 1, int finestStep = 1) {
+
+		cancel();
+		pin();
+
+		delete frameCamera;
+		frameCamera = camera->clone();
+
+		reprojecting = false;
+		viewMoved = false;
+		relighting = false;
+		measuring = true;
+		frameCounters = RenderStats::snapshot();
+		submit(width, height, coarsestStep, finestStep);
+	}
+
+	// Starts a single level frame seeded from the last complete one, at the
+	// finest power of two step up to maxStep whose samples are estimated to
+	// cast at most rays: tracedCost() each where no seed lands, reusedCost()
+	// where one does. Returns the step, or 0 without starting anything if
+	// none fits, if there is no complete frame of this size, or the world
+	// has too many lights to record.
+	int startReprojected(const Camera * camera, int width, int height, long rays, int maxStep = 1) {
+
+		cancel();
+		pin();
+
+		if (!world->recordable() || !historyValid || historyWidth != width || historyHeight != height)
+			return 0;
+
+		// no step finer than this fits even if every sample were the cheaper kind
+		int step = stepWithin(width, height, rays, std::min(tracedCost(), reusedCost()));
+		if (step > maxStep)
+			return 0;
+
+		delete frameCamera;
+		frameCamera = camera->clone();
+		projectHistory(width, height);
+
+		for (; step <= maxStep; step <<= 1) {
+
+			long samples = (long)((width + step - 1) / step) * ((height + step - 1) / step);
+			long unseeded = seed(width, height, step);
+			if (unseeded * tracedCost() + (samples - unseeded) * reusedCost() > rays)
+				continue;
+
+			reprojecting = true;
+			viewMoved = true;
+			relighting = historyVisibility;
+			measuring = false;
+			submit(width, height, step, step);
+			return step;
+		}
+		return 0;
+	}
+
+	// The rays of a motion frame unless the viewer is told otherwise, the
+	// step 4 frame of a 1024x1024 window at about 4.5 rays per sample.
+	enum { defaultMotionRays = 1 << 19 };
+
+	// Starts the frame shown while the camera moves, estimated to cast at
+	// most rays: a single level at the finest power of two step that fits,
+	// seeded from the last complete frame when that fits at the same step
+	// or a finer one. Returns the step, reprojected tells whether it is
+	// seeded.
+	int startMotion(const Camera * camera, int width, int height, long rays, bool & reprojected) {
+
+		int step = stepWithin(width, height, rays, tracedCost());
+		int seededStep = startReprojected(camera, width, height, rays, step);
+
+		reprojected = seededStep > 0;
+		if (reprojected)
+			return seededStep;
+
+		start(camera, width, height, step, step);
+		return step;
+	}
+
+	// The finest power of two step whose samples, at cost rays each, come
+	// to at most rays, or the one that takes a single sample.
+	static int stepWithin(int width, int height, long rays, float cost) {
+
+		int step = 1;
+		while ((step < width || step < height) && ((long)((width + step - 1) / step) * ((height + step - 1) / step)) * cost > rays)
+			step <<= 1;
+		return step;
+	}
+
+	// Rays a traced sample casts: its primary ray, a shadow ray per light
+	// and its mirror reflections.
+	float tracedCost() const { return tracedRays; }
+	// Rays a sample reused from the last complete frame casts: the one
+	// finding whether it is hidden now, its mirror reflections with the rays
+	// their hits cast in turn, as many per reflection as a traced sample
+	// casts per hit, and while visibility is outdated a shadow ray per
+	// light.
+	float reusedCost() const {
+		return 1.0f + mirrorRays * tracedRays / (1.0f + mirrorRays) + (historyVisibility ? world->lights.size() : 0);
+	}
+
+	// Shades the last complete frame again after lights or surfaces changed,
+	// from its records alone. With visibility the shadow rays are traced
+	// again, needed when a light moved. Moved objects change the hits
+	// themselves, after those the frame is traced anew, see
+	// invalidateHistory(). Returns false, without starting anything, if the
+	// last complete frame has another view or the world has too many lights
+	// to record.
+	bool startRelit(const Camera * camera, int width, int height, bool visibility) {
+
+		cancel();
+		pin();
+
+		if (!world->recordable() || !historyValid || historyWidth != width || historyHeight != height || !historyCamera->sameView(camera))
+			return false;
+
+		delete frameCamera;
+		frameCamera = camera->clone();
+
+		seeds.resize(width * height);
+		for (int i = 0; i < seeds.size(); i++)
+			seeds[i] = i;
+		// a relit frame that did not complete leaves its changes pending
+		historyVisibility = historyVisibility || visibility;
+		reprojecting = true;
+		viewMoved = false;
+		relighting = historyVisibility;
+		measuring = false;
+		submit(width, height, 1, 1);
+		return true;
+	}
+
+	// Forgets the records, e.g. after the scene changed.
+	void invalidateHistory() {
+
+		cancel();
+		historyValid = false;
+	}
+
+	// Drops the current frame and blocks until no worker touches it anymore.
+	void cancel() {
+
+		std::unique_lock<std::mutex> guard(lock);
+		generation++;
+
+		while (inFlight > 0)
+			changed.wait(guard);
+
+		for (int i = 0; i < finishedTiles.size(); i++)
+			delete finishedTiles[i];
+		finishedTiles.clear();
+
+		tilesTotal = 0;
+		tilesCollected = 0;
+	}
+
+	// Returns the next finished tile, waiting up to timeoutMs for one. The
+	// caller owns the returned tile.
+	Tile * next(int timeoutMs) {
+
+		std::unique_lock<std::mutex> guard(lock);
+		if (finishedTiles.empty() && timeoutMs > 0 && tilesCollected < tilesTotal)
+			changed.wait_for(guard, std::chrono::milliseconds(timeoutMs));
+
+		if (finishedTiles.empty())
+			return NULL;
+
+		Tile * tile = finishedTiles.front();
+		finishedTiles.pop_front();
+		tilesCollected++;
+
+		if (tilesCollected == tilesTotal && measuring) {
+			RenderStats counters = RenderStats::snapshot() - frameCounters;
+			if (counters[STAT_PRIMARY_RAYS] > 0) {
+				tracedRays = (float)counters.rays() / counters[STAT_PRIMARY_RAYS];
+				mirrorRays = (float)counters[STAT_REFLECTION_RAYS] / counters[STAT_PRIMARY_RAYS];
+			}
+			measuring = false;
+		}
+
+		// all tiles are in, the records of this frame are complete
+		if (tilesCollected == tilesTotal && recording) {
+			history.swap(records);
+			historyWidth = frameWidth;
+			historyHeight = history.size() / frameWidth;
+			delete historyCamera;
+			historyCamera = frameCamera->clone();
+			historyValid = true;
+			historyVisibility = false;
+			recording = false;
+		}
+		return tile;
+	}
+};
+
+#endif
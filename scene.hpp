@@ -0,0 +1,114 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <memory>
+#include "world.hpp"
+
+// A world together with the camera looking at it. Owns the camera and
+// shares the world, e.g. with the WorldVersions it becomes the first of.
+class Scene
+{
+public:
+	std::shared_ptr<World> world;
+	Camera * camera;
+
+	Scene(World * _world, Camera * _camera) : world(_world), camera(_camera) {}
+	~Scene() {
+
+		delete camera;
+	}
+};
+
+// The camera of the demo scene, also used by scene files without one.
+inline Camera * defaultCamera(int width, int height) {
+
+	Vec3<float> origin(-14.0f, 40.0f, -40.0f);
+	float rotationHorizontal = 0.68f;
+	float rotationVertical = 0.25f;
+	float viewPort = 1.5f;
+
+	return new Cam_Std(	
+		width, 
+		height, 
+		origin, 
+		rotationHorizontal, 
+		rotationVertical, 
+		viewPort);
+}
+
+// The demo scene: two planes and four spheres under two lights, seen
+// through a width x height camera. The world is already built.
+inline Scene * defaultScene(int width, int height) {
+
+	Camera * camera = defaultCamera(width, height);
+
+	World * world = new World();
+
+	// lights
+
+	Color l1Color(1.0f, 1.0f, 1.0f);
+	Vec3<float> l1Origin(0.0f, 100.0f, 0.0f);
+	world->addLight(new Light(l1Color, l1Origin));
+
+	Color l2Color(1.0f, 1.0f, 1.0f);
+	Vec3<float> l2Origin(-30.0f, 50.0f, 0.15f);
+	world->addLight(new Light(l2Color, l2Origin));
+
+	// objects
+
+	Surface * p1Surface = new Surface();
+	p1Surface->setColor(0.8f, 0.8f, 0.8f);
+	p1Surface->setMirror(0.1f);
+
+	Vec3<float> p1Origin(0.0f, 0.0f, 0.0f);
+	Vec3<float> p1Normal(0.0f, 1.0f, 0.0f);
+	world->addWorldObject(new WO_Plane(p1Surface, p1Origin, p1Normal));
+
+
+	Surface * p2Surface = new Surface();
+	p2Surface->setColor(0.0f, 1.0f, 0.0f);
+
+	Vec3<float> p2Origin(5.0f, 5.0f, 0.0f);
+	Vec3<float> p2Normal(-1.0f, 0.5f, -1.0f);
+	world->addWorldObject(new WO_Plane(p2Surface, p2Origin, p2Normal));
+
+
+	Surface * s1Surface = new Surface();
+	s1Surface->setColor(0.3f, 0.3f, 1.0f);
+	//s1Surface->setShadingModel(0.0f, 0.3f, 0.7f);
+	s1Surface->setMirror(0.3f);
+	
+	Vec3<float> s1Origin(-5.0f, 5.0f, 0.0f);
+	float s1Radius = 10.0f;
+	world->addWorldObject(new WO_Sphere(s1Surface, s1Origin, s1Radius));
+
+
+	Surface * s2Surface = new Surface();
+	s2Surface->setColor(0.0f, 1.0f, 1.0f);
+
+	Vec3<float> s2Origin(-5.0f, 40.0f, -20.0f);
+	float s2Radius = 3.0f;
+	world->addWorldObject(new WO_Sphere(s2Surface, s2Origin, s2Radius));
+
+
+	Surface * s3Surface = new Surface();
+	s3Surface->setColor(1.0f, 0.0f, 1.0f);
+
+	Vec3<float> s3Origin(-25.0f, 15.0f, -30.0f);
+	float s3Radius = 10.0f;
+	world->addWorldObject(new WO_Sphere(s3Surface, s3Origin, s3Radius));
+
+
+	Surface * s4Surface = new Surface();
+	s4Surface->setColor(1.0f, 1.0f, 0.0f);
+
+	Vec3<float> s4Origin(-40.0f, 10.0f, 0.0f);
+	float s4Radius = 10.0f;
+	world->addWorldObject(new WO_Sphere(s4Surface, s4Origin, s4Radius));
+
+	world->build();
+
+	return new Scene(world, camera);
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <algorithm>
+#include "stats.hpp"
+
+// Sizes the batches of work done per idle() call so one call takes about
+// budget seconds, from a running estimate of the cost of one item. The
+// display is refreshed every latency seconds, which bounds how long input
+// waits to be seen.
+class BatchScheduler
+{
+private:
+	double budget;
+	double latency;
+	double itemCost;
+	int maxBatch;
+
+	int batches;
+	long items;
+	double busy;
+
+public:
+	BatchScheduler(double _budget = 0.008, double _latency = 0.033, int _maxBatch = 1 << 16)
+	: budget(_budget), latency(_latency), itemCost(0.0), maxBatch(_maxBatch)
+	, batches(0), items(0), busy(0.0) {}
+
+	void setBudget(double seconds) { budget = seconds; }
+	void setLatency(double seconds) { latency = seconds; }
+	double getBudget() const { return budget; }
+	double getLatency() const { return latency; }
+	int latencyMs() const { return std::max(1, (int)(latency * 1000.0 + 0.5)); }
+
+	// Items to do in the next batch. Until the first measurement only one.
+	int nextBatch() const {
+
+		if (itemCost <= 0.0)
+			return 1;
+		return std::max(1, std::min(maxBatch, (int)(budget / itemCost)));
+	}
+
+	// Batches that did nothing tell nothing about the cost of an item.
+	void record(int count, double seconds) {
+
+		batches++;
+		busy += seconds;
+		if (count <= 0)
+			return;
+
+		items += count;
+		double cost = seconds / count;
+		itemCost = itemCost <= 0.0 ? cost : 0.8 * itemCost + 0.2 * cost;
+	}
+
+	// Adds the schedule to the stats of a frame and starts counting anew.
+	void report(FrameStats & stats) {
+
+		stats.budgetSeconds = budget;
+		stats.latencySeconds = latency;
+		stats.batches = batches;
+		stats.batchItems = items;
+		stats.batchSeconds = busy;
+		stats.itemSeconds = itemCost;
+
+		batches = 0;
+		items = 0;
+		busy = 0.0;
+	}
+};
+
+#endif
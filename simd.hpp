@@ -0,0 +1,532 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "vec3.hpp"
+#include "table.hpp"
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// The vector kernels below perform exactly the same float operations in the
+// same order as the scalar ones, so all levels give bit-identical results as
+// long as the compiler does not contract them (see -ffp-contract=off in
+// CMakeLists.txt).
+enum SimdLevel
+{
+	SIMD_SCALAR,
+	SIMD_SSE,
+	SIMD_AVX2
+};
+
+inline SimdLevel detectSimdLevel() {
+
+#ifdef RT_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	return SIMD_SSE;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+inline SimdLevel & simdLevel() {
+
+	static SimdLevel level = detectSimdLevel();
+	return level;
+}
+
+// Selects the kernels used from now on, capped to what the cpu supports.
+inline void setSimdLevel(SimdLevel level) {
+
+	SimdLevel best = detectSimdLevel();
+	simdLevel() = level < best ? level : best;
+}
+
+inline const char * simdLevelName(SimdLevel level) {
+
+	return level == SIMD_AVX2 ? "avx2" : (level == SIMD_SSE ? "sse" : "scalar");
+}
+
+// Ray data shared by all kernels.
+struct SimdRay
+{
+	float ox, oy, oz;
+	float dx, dy, dz;
+	float a;
+
+	SimdRay() {}
+	SimdRay(const Vec3<float> & origin, const Vec3<float> & direction) {
+		ox = origin.getX();
+		oy = origin.getY();
+		oz = origin.getZ();
+		dx = direction.getX();
+		dy = direction.getY();
+		dz = direction.getZ();
+		a = dx * dx + dy * dy + dz * dz;
+	}
+};
+
+// ------------ Scalar kernels ------------
+
+inline float intersectSphere(const SimdRay & r, float cx, float cy, float cz, float r2) {
+
+	float ocx = r.ox - cx;
+	float ocy = r.oy - cy;
+	float ocz = r.oz - cz;
+
+	float b = 2 * (r.dx * ocx + r.dy * ocy + r.dz * ocz);
+	float c = (ocx * ocx + ocy * ocy + ocz * ocz) - r2;
+
+	float tmp = b * b - 4 * r.a * c;
+	if (tmp < 0.0f)
+		return -1.0f;
+
+	// one float root as in the vector kernels, where the original sphere
+	// took three double ones; hits move by up to about 2e-4 in the image
+	float root = std::sqrt(tmp);
+	if (-b + root < 0.0f)
+		return -1.0f;
+
+	if (-b - root > 0.0f)
+		return (-b - root) / r.a / 2;
+	else
+		return (-b + root) / r.a / 2;
+}
+
+inline float intersectPlane(const SimdRay & r, float px, float py, float pz, float nx, float ny, float nz) {
+
+	float denom = r.dx * nx + r.dy * ny + r.dz * nz;
+	if (denom == 0.0f)
+		return -1.0f;
+
+	return -(nx * (r.ox - px) + ny * (r.oy - py) + nz * (r.oz - pz)) / denom;
+}
+
+// ------------ Vector kernels ------------
+
+#ifdef RT_SIMD_X86
+
+inline void sphereTimesSSE(const float * cx, const float * cy, const float * cz, const float * r2, const SimdRay & r, float * out) {
+
+	__m128 ocx = _mm_sub_ps(_mm_set1_ps(r.ox), _mm_loadu_ps(cx));
+	__m128 ocy = _mm_sub_ps(_mm_set1_ps(r.oy), _mm_loadu_ps(cy));
+	__m128 ocz = _mm_sub_ps(_mm_set1_ps(r.oz), _mm_loadu_ps(cz));
+	__m128 a = _mm_set1_ps(r.a);
+
+	__m128 dot = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_set1_ps(r.dx), ocx),
+		_mm_mul_ps(_mm_set1_ps(r.dy), ocy)),
+		_mm_mul_ps(_mm_set1_ps(r.dz), ocz));
+	__m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), dot);
+	__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(ocx, ocx),
+		_mm_mul_ps(ocy, ocy)),
+		_mm_mul_ps(ocz, ocz)), _mm_loadu_ps(r2));
+
+	__m128 tmp = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), a), c));
+	__m128 root = _mm_sqrt_ps(tmp);
+	__m128 nb = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+	__m128 far = _mm_add_ps(nb, root);
+	__m128 near = _mm_sub_ps(nb, root);
+
+	__m128 useNear = _mm_cmpgt_ps(near, _mm_setzero_ps());
+	__m128 num = _mm_or_ps(_mm_and_ps(useNear, near), _mm_andnot_ps(useNear, far));
+	__m128 t = _mm_mul_ps(_mm_div_ps(num, a), _mm_set1_ps(0.5f));
+
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tmp, _mm_setzero_ps()), _mm_cmpge_ps(far, _mm_setzero_ps()));
+	t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, _mm_set1_ps(-1.0f)));
+
+	_mm_storeu_ps(out, t);
+}
+
+__attribute__((target("avx2")))
+inline void sphereTimesAVX2(const float * cx, const float * cy, const float * cz, const float * r2, const SimdRay & r, float * out) {
+
+	__m256 ocx = _mm256_sub_ps(_mm256_set1_ps(r.ox), _mm256_loadu_ps(cx));
+	__m256 ocy = _mm256_sub_ps(_mm256_set1_ps(r.oy), _mm256_loadu_ps(cy));
+	__m256 ocz = _mm256_sub_ps(_mm256_set1_ps(r.oz), _mm256_loadu_ps(cz));
+	__m256 a = _mm256_set1_ps(r.a);
+
+	__m256 dot = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(r.dx), ocx),
+		_mm256_mul_ps(_mm256_set1_ps(r.dy), ocy)),
+		_mm256_mul_ps(_mm256_set1_ps(r.dz), ocz));
+	__m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), dot);
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(ocx, ocx),
+		_mm256_mul_ps(ocy, ocy)),
+		_mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(r2));
+
+	__m256 tmp = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), a), c));
+	__m256 root = _mm256_sqrt_ps(tmp);
+	__m256 nb = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+	__m256 far = _mm256_add_ps(nb, root);
+	__m256 near = _mm256_sub_ps(nb, root);
+
+	__m256 useNear = _mm256_cmp_ps(near, _mm256_setzero_ps(), _CMP_GT_OQ);
+	__m256 t = _mm256_mul_ps(_mm256_div_ps(_mm256_blendv_ps(far, near, useNear), a), _mm256_set1_ps(0.5f));
+
+	__m256 hit = _mm256_and_ps(
+		_mm256_cmp_ps(tmp, _mm256_setzero_ps(), _CMP_GE_OQ),
+		_mm256_cmp_ps(far, _mm256_setzero_ps(), _CMP_GE_OQ));
+	t = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), t, hit);
+
+	_mm256_storeu_ps(out, t);
+}
+
+inline void planeTimesSSE(const float * px, const float * py, const float * pz, const float * nx, const float * ny, const float * nz, const SimdRay & r, float * out) {
+
+	__m128 vnx = _mm_loadu_ps(nx);
+	__m128 vny = _mm_loadu_ps(ny);
+	__m128 vnz = _mm_loadu_ps(nz);
+
+	__m128 denom = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_set1_ps(r.dx), vnx),
+		_mm_mul_ps(_mm_set1_ps(r.dy), vny)),
+		_mm_mul_ps(_mm_set1_ps(r.dz), vnz));
+	__m128 num = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(vnx, _mm_sub_ps(_mm_set1_ps(r.ox), _mm_loadu_ps(px))),
+		_mm_mul_ps(vny, _mm_sub_ps(_mm_set1_ps(r.oy), _mm_loadu_ps(py)))),
+		_mm_mul_ps(vnz, _mm_sub_ps(_mm_set1_ps(r.oz), _mm_loadu_ps(pz))));
+	__m128 t = _mm_div_ps(_mm_xor_ps(num, _mm_set1_ps(-0.0f)), denom);
+
+	__m128 parallel = _mm_cmpeq_ps(denom, _mm_setzero_ps());
+	t = _mm_or_ps(_mm_and_ps(parallel, _mm_set1_ps(-1.0f)), _mm_andnot_ps(parallel, t));
+
+	_mm_storeu_ps(out, t);
+}
+
+__attribute__((target("avx2")))
+inline void planeTimesAVX2(const float * px, const float * py, const float * pz, const float * nx, const float * ny, const float * nz, const SimdRay & r, float * out) {
+
+	__m256 vnx = _mm256_loadu_ps(nx);
+	__m256 vny = _mm256_loadu_ps(ny);
+	__m256 vnz = _mm256_loadu_ps(nz);
+
+	__m256 denom = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(r.dx), vnx),
+		_mm256_mul_ps(_mm256_set1_ps(r.dy), vny)),
+		_mm256_mul_ps(_mm256_set1_ps(r.dz), vnz));
+	__m256 num = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(vnx, _mm256_sub_ps(_mm256_set1_ps(r.ox), _mm256_loadu_ps(px))),
+		_mm256_mul_ps(vny, _mm256_sub_ps(_mm256_set1_ps(r.oy), _mm256_loadu_ps(py)))),
+		_mm256_mul_ps(vnz, _mm256_sub_ps(_mm256_set1_ps(r.oz), _mm256_loadu_ps(pz))));
+	__m256 t = _mm256_div_ps(_mm256_xor_ps(num, _mm256_set1_ps(-0.0f)), denom);
+
+	__m256 parallel = _mm256_cmp_ps(denom, _mm256_setzero_ps(), _CMP_EQ_OQ);
+	t = _mm256_blendv_ps(t, _mm256_set1_ps(-1.0f), parallel);
+
+	_mm256_storeu_ps(out, t);
+}
+
+#endif
+
+// ------------ Packet box test ------------
+
+// Slab test of the 16 rays of a packet (origins, inverse directions and
+// tMax as structure of arrays) against one box. Returns a mask of the lanes
+// that hit it. A ray parallel to an axis whose origin lies on a plane of
+// the box gets 0 * inf = NaN for that axis; every level treats the ray as
+// inside that slab then, so the result does not depend on the CPU.
+inline unsigned boxLanesScalar(const float (*origin)[16], const float (*invDir)[16], const float * tMax, const float * lower, const float * upper) {
+
+	unsigned mask = 0;
+	for (int i = 0; i < 16; i++) {
+
+		float tNear = 0.0f;
+		float tFar = tMax[i];
+		for (int a = 0; a < 3; a++) {
+			float t0 = (lower[a] - origin[a][i]) * invDir[a][i];
+			float t1 = (upper[a] - origin[a][i]) * invDir[a][i];
+			if (t0 != t0 || t1 != t1)
+				continue;
+			tNear = std::max(tNear, std::min(t0, t1));
+			tFar = std::min(tFar, std::max(t0, t1));
+		}
+		if (tNear <= tFar)
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+#ifdef RT_SIMD_X86
+
+inline unsigned boxLanesSSE(const float (*origin)[16], const float (*invDir)[16], const float * tMax, const float * lower, const float * upper) {
+
+	unsigned mask = 0;
+	for (int base = 0; base < 16; base += 4) {
+
+		__m128 tNear = _mm_setzero_ps();
+		__m128 tFar = _mm_loadu_ps(tMax + base);
+		for (int a = 0; a < 3; a++) {
+			__m128 o = _mm_loadu_ps(origin[a] + base);
+			__m128 inv = _mm_loadu_ps(invDir[a] + base);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(lower[a]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(upper[a]), o), inv);
+			// NaN bounds, which max and min pass over as their first operand
+			__m128 nan = _mm_cmpunord_ps(t0, t1);
+			tNear = _mm_max_ps(_mm_or_ps(_mm_min_ps(t0, t1), nan), tNear);
+			tFar = _mm_min_ps(_mm_or_ps(_mm_max_ps(t0, t1), nan), tFar);
+		}
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << base;
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+inline unsigned boxLanesAVX2(const float (*origin)[16], const float (*invDir)[16], const float * tMax, const float * lower, const float * upper) {
+
+	unsigned mask = 0;
+	for (int base = 0; base < 16; base += 8) {
+
+		__m256 tNear = _mm256_setzero_ps();
+		__m256 tFar = _mm256_loadu_ps(tMax + base);
+		for (int a = 0; a < 3; a++) {
+			__m256 o = _mm256_loadu_ps(origin[a] + base);
+			__m256 inv = _mm256_loadu_ps(invDir[a] + base);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lower[a]), o), inv);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upper[a]), o), inv);
+			__m256 nan = _mm256_cmp_ps(t0, t1, _CMP_UNORD_Q);
+			tNear = _mm256_max_ps(_mm256_or_ps(_mm256_min_ps(t0, t1), nan), tNear);
+			tFar = _mm256_min_ps(_mm256_or_ps(_mm256_max_ps(t0, t1), nan), tFar);
+		}
+		mask |= _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) << base;
+	}
+	return mask;
+}
+
+#endif
+
+inline unsigned boxLanes(const float (*origin)[16], const float (*invDir)[16], const float * tMax, const float * lower, const float * upper) {
+
+	switch (simdLevel()) {
+#ifdef RT_SIMD_X86
+	case SIMD_AVX2:
+		return boxLanesAVX2(origin, invDir, tMax, lower, upper);
+	case SIMD_SSE:
+		return boxLanesSSE(origin, invDir, tMax, lower, upper);
+#endif
+	default:
+		return boxLanesScalar(origin, invDir, tMax, lower, upper);
+	}
+}
+
+// ------------ Structure of arrays storage ------------
+
+// Lanes are evaluated in blocks of up to simdBlock entries. The arrays carry
+// simdBlock entries of padding so a block may always be loaded in full.
+static const int simdBlock = 8;
+
+inline int simdWidth() {
+
+	return simdLevel() == SIMD_SSE ? 4 : simdBlock;
+}
+
+// Returns the first lane with the smallest t in (tMin, tMax), shrinking tMax.
+inline int closestLane(const float * t, int base, int count, float tMin, float & tMax) {
+
+	int index = -1;
+	for (int i = 0; i < count; i++) {
+		if (t[i] > tMin && t[i] < tMax) {
+			tMax = t[i];
+			index = base + i;
+		}
+	}
+	return index;
+}
+
+inline bool anyLane(const float * t, int count, float tMin, float tMax) {
+
+	for (int i = 0; i < count; i++)
+		if (t[i] > tMin && t[i] < tMax)
+			return true;
+	return false;
+}
+
+class SphereSoA
+{
+private:
+	Table<float> cx, cy, cz, r2;
+
+	void times(int base, int count, const SimdRay & r, float * t) const {
+
+		switch (simdLevel()) {
+#ifdef RT_SIMD_X86
+		case SIMD_AVX2:
+			sphereTimesAVX2(&cx[base], &cy[base], &cz[base], &r2[base], r, t);
+			break;
+		case SIMD_SSE:
+			sphereTimesSSE(&cx[base], &cy[base], &cz[base], &r2[base], r, t);
+			break;
+#endif
+		default:
+			for (int i = 0; i < count; i++)
+				t[i] = intersectSphere(r, cx[base + i], cy[base + i], cz[base + i], r2[base + i]);
+		}
+	}
+
+public:
+	int size() const { return (int)cx.size() - simdBlock; }
+
+	void resize(int count) {
+		cx.assign(count + simdBlock, 0.0f);
+		cy.assign(count + simdBlock, 0.0f);
+		cz.assign(count + simdBlock, 0.0f);
+		r2.assign(count + simdBlock, 0.0f);
+	}
+	void set(int i, const Vec3<float> & center, float radius) {
+		cx[i] = center.getX();
+		cy[i] = center.getY();
+		cz[i] = center.getZ();
+		r2[i] = radius * radius;
+	}
+
+	// An entry no ray hits, the discriminant comes out as -inf (or NaN).
+	void exclude(int i) {
+		cx[i] = cy[i] = cz[i] = 0.0f;
+		r2[i] = -std::numeric_limits<float>::infinity();
+	}
+
+	template <class Visitor> void visitTables(Visitor & visit) {
+		visit(cx);
+		visit(cy);
+		visit(cz);
+		visit(r2);
+	}
+	bool valid(int count) const {
+		return cx.size() == count + simdBlock && cy.size() == cx.size() && cz.size() == cx.size() && r2.size() == cx.size();
+	}
+
+	int closest(int start, int count, const SimdRay & r, float tMin, float & tMax) const {
+
+		float t[simdBlock];
+		int width = simdWidth();
+		int index = -1;
+
+		for (int base = start; base < start + count; base += width) {
+
+			int n = std::min(width, start + count - base);
+			times(base, n, r, t);
+
+			int lane = closestLane(t, base, n, tMin, tMax);
+			if (lane != -1)
+				index = lane;
+		}
+		return index;
+	}
+
+	bool any(int start, int count, const SimdRay & r, float tMin, float tMax) const {
+
+		float t[simdBlock];
+		int width = simdWidth();
+
+		for (int base = start; base < start + count; base += width) {
+
+			int n = std::min(width, start + count - base);
+			times(base, n, r, t);
+
+			if (anyLane(t, n, tMin, tMax))
+				return true;
+		}
+		return false;
+	}
+};
+
+class PlaneSoA
+{
+private:
+	Table<float> px, py, pz, nx, ny, nz;
+
+	void times(int base, int count, const SimdRay & r, float * t) const {
+
+		switch (simdLevel()) {
+#ifdef RT_SIMD_X86
+		case SIMD_AVX2:
+			planeTimesAVX2(&px[base], &py[base], &pz[base], &nx[base], &ny[base], &nz[base], r, t);
+			break;
+		case SIMD_SSE:
+			planeTimesSSE(&px[base], &py[base], &pz[base], &nx[base], &ny[base], &nz[base], r, t);
+			break;
+#endif
+		default:
+			for (int i = 0; i < count; i++)
+				t[i] = intersectPlane(r, px[base + i], py[base + i], pz[base + i], nx[base + i], ny[base + i], nz[base + i]);
+		}
+	}
+
+public:
+	int size() const { return (int)px.size() - simdBlock; }
+
+	void resize(int count) {
+		px.assign(count + simdBlock, 0.0f);
+		py.assign(count + simdBlock, 0.0f);
+		pz.assign(count + simdBlock, 0.0f);
+		nx.assign(count + simdBlock, 0.0f);
+		ny.assign(count + simdBlock, 0.0f);
+		nz.assign(count + simdBlock, 0.0f);
+	}
+	void set(int i, const Vec3<float> & point, const Vec3<float> & normal) {
+		px[i] = point.getX();
+		py[i] = point.getY();
+		pz[i] = point.getZ();
+		nx[i] = normal.getX();
+		ny[i] = normal.getY();
+		nz[i] = normal.getZ();
+	}
+
+	template <class Visitor> void visitTables(Visitor & visit) {
+		visit(px);
+		visit(py);
+		visit(pz);
+		visit(nx);
+		visit(ny);
+		visit(nz);
+	}
+	bool valid(int count) const {
+		return px.size() == count + simdBlock && py.size() == px.size() && pz.size() == px.size()
+			&& nx.size() == px.size() && ny.size() == px.size() && nz.size() == px.size();
+	}
+
+	int closest(const SimdRay & r, float tMin, float & tMax) const {
+
+		float t[simdBlock];
+		int width = simdWidth();
+		int index = -1;
+
+		for (int base = 0; base < size(); base += width) {
+
+			int n = std::min(width, size() - base);
+			times(base, n, r, t);
+
+			int lane = closestLane(t, base, n, tMin, tMax);
+			if (lane != -1)
+				index = lane;
+		}
+		return index;
+	}
+
+	bool any(const SimdRay & r, float tMin, float tMax) const {
+
+		float t[simdBlock];
+		int width = simdWidth();
+
+		for (int base = 0; base < size(); base += width) {
+
+			int n = std::min(width, size() - base);
+			times(base, n, r, t);
+
+			if (anyLane(t, n, tMin, tMax))
+				return true;
+		}
+		return false;
+	}
+};
+
+#endif
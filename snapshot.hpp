@@ -0,0 +1,260 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene.hpp"
+
+// A built scene as a file that is mapped into memory and traced from as it
+// is: the tables of World::visitTables, the lights and the camera. Nothing
+// is parsed or copied on loading, the pages are read in as tracing touches
+// them, and processes that map the same file share them in the page cache.
+//
+// The file starts with a SnapshotHeader, followed by one SnapshotSection
+// per table. Each section points at the raw elements of its table, 64 byte
+// aligned. A file written by another version, or with other element sizes
+// or byte order, is refused, and so is one whose indices point outside
+// their tables (see World::validTables). That check reads the index tables
+// once, the geometry is still only read as tracing touches it.
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t sections;
+	uint32_t hasCamera;
+	float camera[6];	// origin, horizontal and vertical rotation, view port
+};
+
+struct SnapshotSection
+{
+	uint64_t offset;
+	uint64_t count;
+	uint32_t elementSize;
+	uint32_t reserved;
+};
+
+struct SnapshotLight
+{
+	float color[3];
+	float origin[3];
+};
+
+static const char snapshotMagic[8] = { 'R', 'T', 'S', 'N', 'A', 'P', '\r', '\n' };
+enum { snapshotVersion = 1, snapshotByteOrder = 0x01020304, snapshotAlignment = 64 };
+
+// Whether the file at path starts like a snapshot.
+inline bool isSnapshot(const std::string & path) {
+
+	char magic[8];
+	FILE * file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	bool match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, snapshotMagic, sizeof(magic)) == 0;
+	fclose(file);
+	return match;
+}
+
+class SnapshotWriter
+{
+private:
+	struct Part
+	{
+		const void * data;
+		uint64_t count;
+		uint32_t elementSize;
+	};
+	std::vector<Part> parts;
+
+	void add(const void * data, uint64_t count, uint32_t elementSize) {
+		Part part = { data, count, elementSize };
+		parts.push_back(part);
+	}
+
+public:
+	template <class T> void operator()(Table<T> & table) {
+		add(table.data(), table.size(), sizeof(T));
+	}
+
+	// Writes the scene, building its world first if needed. False with the
+	// reason in error if it cannot.
+	bool write(const std::string & path, Scene * scene, std::string & error) {
+
+		World * world = scene->world.get();
+		if (!world->inTables()) {
+			error = "the scene holds meshes, objects or surfaces a snapshot cannot describe";
+			return false;
+		}
+		if (!world->isBuilt())
+			world->build();
+
+		SnapshotHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+		header.version = snapshotVersion;
+		header.byteOrder = snapshotByteOrder;
+
+		const Cam_Std * camera = dynamic_cast<const Cam_Std*>(scene->camera);
+		if (camera) {
+			header.hasCamera = 1;
+			header.camera[0] = camera->getOrigin().getX();
+			header.camera[1] = camera->getOrigin().getY();
+			header.camera[2] = camera->getOrigin().getZ();
+			header.camera[3] = camera->getRotationHorizontal();
+			header.camera[4] = camera->getRotationVertical();
+			header.camera[5] = camera->getViewPort();
+		}
+
+		std::vector<SnapshotLight> lights(world->lights.size());
+		for (int i = 0; i < lights.size(); i++) {
+			const Light * light = world->lights[i];
+			SnapshotLight record = { { light->color.r, light->color.g, light->color.b },
+				{ light->origin.getX(), light->origin.getY(), light->origin.getZ() } };
+			lights[i] = record;
+		}
+
+		parts.clear();
+		add(lights.empty() ? NULL : &lights[0], lights.size(), sizeof(SnapshotLight));
+		world->visitTables(*this);
+		header.sections = parts.size();
+
+		std::vector<SnapshotSection> sections(parts.size());
+		uint64_t offset = sizeof(SnapshotHeader) + parts.size() * sizeof(SnapshotSection);
+		for (int i = 0; i < parts.size(); i++) {
+			offset = (offset + snapshotAlignment - 1) / snapshotAlignment * snapshotAlignment;
+			sections[i].offset = offset;
+			sections[i].count = parts[i].count;
+			sections[i].elementSize = parts[i].elementSize;
+			sections[i].reserved = 0;
+			offset += parts[i].count * parts[i].elementSize;
+		}
+
+		FILE * file = fopen(path.c_str(), "wb");
+		if (!file) {
+			error = path + ": cannot open for writing";
+			return false;
+		}
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fwrite(&sections[0], sizeof(SnapshotSection), sections.size(), file) == sections.size();
+
+		static const char zeros[snapshotAlignment] = { 0 };
+		uint64_t position = sizeof(SnapshotHeader) + parts.size() * sizeof(SnapshotSection);
+		for (int i = 0; i < parts.size() && ok; i++) {
+			ok = fwrite(zeros, 1, sections[i].offset - position, file) == sections[i].offset - position;
+			uint64_t bytes = parts[i].count * parts[i].elementSize;
+			ok = ok && (bytes == 0 || fwrite(parts[i].data, 1, bytes, file) == bytes);
+			position = sections[i].offset + bytes;
+		}
+
+		ok = fclose(file) == 0 && ok;
+		if (!ok)
+			error = path + ": write failed";
+		return ok;
+	}
+};
+
+class SnapshotReader
+{
+private:
+	const char * base;
+	uint64_t size;
+	const SnapshotSection * sections;
+	uint32_t count;
+	uint32_t next;
+	bool ok;
+
+public:
+	template <class T> void operator()(Table<T> & table) {
+
+		if (!ok || next >= count || sections[next].elementSize != sizeof(T)) {
+			ok = false;
+			return;
+		}
+
+		const SnapshotSection & section = sections[next++];
+		if (section.offset % snapshotAlignment != 0 || section.offset > size
+			|| section.count > (size - section.offset) / sizeof(T)) {
+			ok = false;
+			return;
+		}
+		table.borrow((const T*)(base + section.offset), section.count);
+	}
+
+	// Maps the snapshot at path and puts a scene on top of it, seen through
+	// a width x height camera. NULL with the reason in error if the file is
+	// no snapshot of this version.
+	Scene * read(const std::string & path, int width, int height, std::string & error) {
+
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			error = path + ": cannot open";
+			return NULL;
+		}
+
+		struct stat status;
+		void * address = MAP_FAILED;
+		if (fstat(fd, &status) == 0 && status.st_size >= (off_t)sizeof(SnapshotHeader))
+			address = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (address == MAP_FAILED) {
+			error = path + ": cannot map";
+			return NULL;
+		}
+
+		size_t length = status.st_size;
+		std::shared_ptr<const void> mapping(address, [length](const void * p) { munmap((void*)p, length); });
+
+		base = (const char*)address;
+		size = length;
+		const SnapshotHeader * header = (const SnapshotHeader*)base;
+
+		if (memcmp(header->magic, snapshotMagic, sizeof(header->magic)) != 0 || header->version != snapshotVersion
+			|| header->byteOrder != snapshotByteOrder
+			|| header->sections > (size - sizeof(SnapshotHeader)) / sizeof(SnapshotSection)) {
+			error = path + ": not a snapshot of this version";
+			return NULL;
+		}
+
+		sections = (const SnapshotSection*)(base + sizeof(SnapshotHeader));
+		count = header->sections;
+		next = 0;
+		ok = true;
+
+		Table<SnapshotLight> lights;
+		(*this)(lights);
+
+		World * world = new World();
+		world->visitTables(*this);
+		if (!ok || next != count || !world->validTables()) {
+			error = path + ": damaged or of another layout";
+			delete world;
+			return NULL;
+		}
+
+		for (int i = 0; i < lights.size(); i++)
+			world->addLight(new Light(Color(lights[i].color[0], lights[i].color[1], lights[i].color[2]),
+				Vec3<float>(lights[i].origin[0], lights[i].origin[1], lights[i].origin[2])));
+		world->adoptTables(mapping);
+
+		Camera * camera;
+		if (header->hasCamera)
+			camera = new Cam_Std(width, height, Vec3<float>(header->camera[0], header->camera[1], header->camera[2]),
+				header->camera[3], header->camera[4], header->camera[5]);
+		else
+			camera = defaultCamera(width, height);
+
+		return new Scene(world, camera);
+	}
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+
+// Render counters. Every thread counts into its own block, so counting is a
+// plain relaxed load and store without any locking or shared cache lines.
+// A snapshot sums the blocks of all threads that ever counted something.
+enum StatCounter
+{
+	STAT_PRIMARY_RAYS,
+	STAT_SHADOW_RAYS,
+	STAT_REFLECTION_RAYS,
+	STAT_INTERSECTION_TESTS,
+	STAT_REPROJECTED_PIXELS,	// shaded from the previous frame's hits
+	STAT_TERMINATED_PATHS,	// mirror reflections left out for their low throughput
+	STAT_DEPTH,	// histogram of the recursion depth of shaded rays
+	STAT_COUNT = STAT_DEPTH + 12
+};
+
+class RenderStats
+{
+public:
+	enum { depthBins = STAT_COUNT - STAT_DEPTH };
+
+	unsigned long counters[STAT_COUNT];
+
+	RenderStats() {
+
+		for (int i = 0; i < STAT_COUNT; i++)
+			counters[i] = 0;
+	}
+
+	unsigned long operator[](int counter) const { return counters[counter]; }
+
+	unsigned long rays() const {
+		return counters[STAT_PRIMARY_RAYS] + counters[STAT_SHADOW_RAYS] + counters[STAT_REFLECTION_RAYS];
+	}
+
+	RenderStats operator-(const RenderStats & other) const {
+
+		RenderStats diff;
+		for (int i = 0; i < STAT_COUNT; i++)
+			diff.counters[i] = counters[i] - other.counters[i];
+		return diff;
+	}
+
+	// Sum over all threads.
+	static RenderStats snapshot();
+};
+
+class StatsRegistry
+{
+public:
+	// Padded so blocks of different threads never share a cache line.
+	struct Block
+	{
+		char before[64];
+		std::atomic<unsigned long> counters[STAT_COUNT];
+		char after[64];
+
+		Block() {
+			for (int i = 0; i < STAT_COUNT; i++)
+				counters[i].store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// Blocks are never freed, a thread that exits leaves its counts behind.
+	static Block * add() {
+
+		Block * block = new Block();
+		std::lock_guard<std::mutex> guard(lock());
+		blocks().push_back(block);
+		return block;
+	}
+
+	static RenderStats sum() {
+
+		RenderStats stats;
+		std::lock_guard<std::mutex> guard(lock());
+		for (int b = 0; b < blocks().size(); b++)
+			for (int i = 0; i < STAT_COUNT; i++)
+				stats.counters[i] += blocks()[b]->counters[i].load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	static std::mutex & lock() {
+		static std::mutex mutex;
+		return mutex;
+	}
+	static std::vector<Block*> & blocks() {
+		static std::vector<Block*> list;
+		return list;
+	}
+};
+
+inline RenderStats RenderStats::snapshot() {
+
+	return StatsRegistry::sum();
+}
+
+inline StatsRegistry::Block * threadStats() {
+
+	static thread_local StatsRegistry::Block * block = StatsRegistry::add();
+	return block;
+}
+
+// Only the owning thread writes its block, so no atomic read-modify-write
+// is needed.
+inline void countStat(StatCounter counter, unsigned long n = 1) {
+
+	std::atomic<unsigned long> & value = threadStats()->counters[counter];
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void countDepth(int depth, unsigned long n = 1) {
+
+	countStat((StatCounter)(STAT_DEPTH + std::min<int>(depth, RenderStats::depthBins - 1)), n);
+}
+
+// Counters and timings of one frame.
+class FrameStats
+{
+public:
+	int width;
+	int height;
+	int finestStep;	// 1 unless rendered at reduced resolution
+	double seconds;
+	std::vector<double> passSeconds;	// since the frame start, per finished pass
+	double uploadSeconds;
+	int uploads;
+	unsigned long uploadBytes;
+	RenderStats counters;
+
+	// batch schedule of the GLUT thread, see BatchScheduler
+	double budgetSeconds;
+	double latencySeconds;
+	int batches;
+	long batchItems;
+	double batchSeconds;
+	double itemSeconds;
+
+	FrameStats() : width(0), height(0), finestStep(1), seconds(0.0), uploadSeconds(0.0), uploads(0), uploadBytes(0)
+	, budgetSeconds(0.0), latencySeconds(0.0), batches(0), batchItems(0), batchSeconds(0.0), itemSeconds(0.0) {}
+
+	std::string json() const {
+
+		char buffer[256];
+		std::string out;
+
+		snprintf(buffer, sizeof(buffer), "{\"width\": %d, \"height\": %d, \"finest_step\": %d, \"seconds\": %.6f, ", 
+			width, height, finestStep, seconds);
+		out += buffer;
+		snprintf(buffer, sizeof(buffer), "\"rays\": %lu, \"primary_rays\": %lu, \"shadow_rays\": %lu, \"reflection_rays\": %lu, ",
+			counters.rays(), counters[STAT_PRIMARY_RAYS], counters[STAT_SHADOW_RAYS], counters[STAT_REFLECTION_RAYS]);
+		out += buffer;
+		snprintf(buffer, sizeof(buffer), "\"intersection_tests\": %lu, \"reprojected_pixels\": %lu, \"terminated_paths\": %lu, \"depth\": [", 
+			counters[STAT_INTERSECTION_TESTS], counters[STAT_REPROJECTED_PIXELS], counters[STAT_TERMINATED_PATHS]);
+		out += buffer;
+
+		for (int i = 0; i < RenderStats::depthBins; i++) {
+			snprintf(buffer, sizeof(buffer), "%s%lu", i ? ", " : "", counters[STAT_DEPTH + i]);
+			out += buffer;
+		}
+
+		out += "], \"pass_seconds\": [";
+		for (int i = 0; i < passSeconds.size(); i++) {
+			snprintf(buffer, sizeof(buffer), "%s%.6f", i ? ", " : "", passSeconds[i]);
+			out += buffer;
+		}
+
+		snprintf(buffer, sizeof(buffer), "], \"upload_seconds\": %.6f, \"uploads\": %d, \"upload_bytes\": %lu, ", 
+			uploadSeconds, uploads, uploadBytes);
+		out += buffer;
+		snprintf(buffer, sizeof(buffer), "\"budget_seconds\": %.6f, \"latency_seconds\": %.6f, \"batches\": %d, \"batch_items\": %ld, \"batch_seconds\": %.6f, \"item_seconds\": %.9f}",
+			budgetSeconds, latencySeconds, batches, batchItems, batchSeconds, itemSeconds);
+		out += buffer;
+		return out;
+	}
+
+	// One line for the window title.
+	std::string summary() const {
+
+		char buffer[160];
+		snprintf(buffer, sizeof(buffer), "%dx%d  %.0f ms  %.2f Mrays  %.2f Mrays/s  %.0f tests/ray",
+			width, height, seconds * 1e3, counters.rays() / 1e6,
+			seconds > 0.0 ? counters.rays() / seconds / 1e6 : 0.0,
+			counters.rays() ? (double)counters[STAT_INTERSECTION_TESTS] / counters.rays() : 0.0);
+		return buffer;
+	}
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef TABLE_HPP
+#define TABLE_HPP
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstddef>
+
+// Contiguous elements of a plain data type, either owned like a std::vector
+// or borrowed from memory that outlives the table, e.g. a mapped snapshot
+// file (see snapshot.hpp). Reading costs the same either way. Copies share
+// the elements, so copying a World is cheap (see WorldVersions). Changing a
+// borrowed or shared table copies it first.
+template <class T> class Table
+{
+private:
+	std::shared_ptr<std::vector<T> > owned;
+	const T * items;
+	size_t count;
+	bool borrowed;
+
+	void sync() {
+		items = owned->empty() ? NULL : &(*owned)[0];
+		count = owned->size();
+	}
+	void own() {
+		if (borrowed) {
+			owned = std::make_shared<std::vector<T> >(items, items + count);
+			borrowed = false;
+			sync();
+		}
+		else if (!owned) {
+			owned = std::make_shared<std::vector<T> >();
+		}
+		else if (owned.use_count() > 1) {
+			owned = std::make_shared<std::vector<T> >(*owned);
+			sync();
+		}
+		// the last other owner may have dropped the elements on another
+		// thread, its reads come before our writes
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
+
+public:
+	Table() : items(NULL), count(0), borrowed(false) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T * data() const { return items; }
+	bool isBorrowed() const { return borrowed; }
+
+	const T & operator[](size_t i) const { return items[i]; }
+	T & operator[](size_t i) { own(); return (*owned)[i]; }
+	T & back() { own(); return owned->back(); }
+
+	void push_back(const T & value) { own(); owned->push_back(value); sync(); }
+	void reserve(size_t n) { own(); owned->reserve(n); sync(); }
+	void resize(size_t n) { own(); owned->resize(n); sync(); }
+	void assign(size_t n, const T & value) {
+		borrowed = false;
+		owned = std::make_shared<std::vector<T> >(n, value);
+		sync();
+	}
+	void clear() {
+		if (borrowed || !owned || owned.use_count() > 1)
+			owned = std::make_shared<std::vector<T> >();
+		borrowed = false;
+		owned->clear();
+		sync();
+	}
+
+	// Points the table at n elements in memory owned elsewhere.
+	void borrow(const T * data, size_t n) {
+		owned.reset();
+		items = data;
+		count = n;
+		borrowed = true;
+	}
+};
+
+#endif
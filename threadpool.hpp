@@ -0,0 +1,134 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Fixed set of worker threads, each owning a job queue. A worker takes jobs
+// from the front of its own queue and, once that runs dry, steals from the
+// back of the other queues before going to sleep.
+class ThreadPool
+{
+private:
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<std::function<void()> > jobs;
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<Queue*> queues;
+
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	std::atomic<int> pending;
+	std::atomic<unsigned> nextQueue;
+	bool stopping;
+
+	bool popOwn(int id, std::function<void()> & job) {
+
+		Queue * q = queues[id];
+		std::lock_guard<std::mutex> guard(q->lock);
+		if (q->jobs.empty())
+			return false;
+
+		job.swap(q->jobs.front());
+		q->jobs.pop_front();
+		return true;
+	}
+
+	bool steal(int id, std::function<void()> & job) {
+
+		for (int i = 1; i < queues.size(); i++) {
+
+			Queue * q = queues[(id + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(q->lock);
+			if (q->jobs.empty())
+				continue;
+
+			job.swap(q->jobs.back());
+			q->jobs.pop_back();
+			return true;
+		}
+
+		return false;
+	}
+
+	void run(int id) {
+
+		std::function<void()> job;
+
+		while (true) {
+
+			if (popOwn(id, job) || steal(id, job)) {
+				pending--;
+				job();
+				job = std::function<void()>();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(sleepLock);
+			if (stopping)
+				return;
+			if (pending.load() == 0)
+				wake.wait(guard);
+		}
+	}
+
+public:
+	ThreadPool(int count) : pending(0), nextQueue(0), stopping(false) {
+
+		if (count < 1)
+			count = 1;
+
+		for (int i = 0; i < count; i++)
+			queues.push_back(new Queue());
+
+		for (int i = 0; i < count; i++)
+			threads.push_back(std::thread(&ThreadPool::run, this, i));
+	}
+	~ThreadPool() {
+
+		{
+			std::lock_guard<std::mutex> guard(sleepLock);
+			stopping = true;
+		}
+		wake.notify_all();
+
+		for (int i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		for (int i = 0; i < queues.size(); i++)
+			delete queues[i];
+	}
+
+	int size() const { return threads.size(); }
+
+	void submit(const std::function<void()> & job) {
+
+		Queue * q = queues[nextQueue++ % queues.size()];
+		{
+			std::lock_guard<std::mutex> guard(q->lock);
+			q->jobs.push_back(job);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(sleepLock);
+			pending++;
+		}
+		wake.notify_one();
+	}
+
+	static int hardwareThreads() {
+
+		int count = std::thread::hardware_concurrency();
+		return count > 0 ? count : 1;
+	}
+};
+
+#endif
@@ -357,7 +357,12 @@ template <class T> class Mat3
             z /= value;
         }
 
-        Mat3 inverse()
+        Mat3 transpose() const
+        {
+            return Mat3<T>(getRowX(), getRowY(), getRowZ());
+        }
+
+        Mat3 inverse() const
         {
             T a = getX().getX();
             T b = getY().getX();
@@ -374,7 +379,7 @@ template <class T> class Mat3
             Vec3<T> v2(c*h - b*i, a*i - c*g, b*g - a*h);
             Vec3<T> v3(b*f - c*e, c*d - a*f, a*e - b*d);
 
-            return Mat3<T>(v1 * det, v2 * det, v3 * det);
+            return Mat3<T>(v1 / det, v2 / det, v3 / det);
         }
 
         Mat3 rotateHor(const T & val) 
@@ -392,4 +397,59 @@ template <class T> Mat3<T> Mat3Identity() {
     return Mat3<T>(1, 0, 0, 0, 1, 0, 0, 0, 1);
 }
 
+// An affine transform: a linear part followed by a translation.
+template <class T> class Transform
+{
+    public:
+        Mat3<T> linear;
+        Vec3<T> translation;
+
+        // ------------ Constructors ------------
+
+        // The identity
+        Transform() : linear(Mat3Identity<T>()) {}
+
+        Transform(const Mat3<T> &linearValue, const Vec3<T> &translationValue)
+        : linear(linearValue), translation(translationValue) {}
+
+        // ------------ Helper methods ------------
+
+        bool isIdentity() const
+        {
+            Mat3<T> id = Mat3Identity<T>();
+            Vec3<T> a[4] = { linear.getX(), linear.getY(), linear.getZ(), translation };
+            Vec3<T> b[4] = { id.getX(), id.getY(), id.getZ(), Vec3<T>() };
+            for (int i = 0; i < 4; i++)
+                if (a[i].getX() != b[i].getX() || a[i].getY() != b[i].getY() || a[i].getZ() != b[i].getZ())
+                    return false;
+            return true;
+        }
+
+        Vec3<T> point(const Vec3<T> &p) const { return linear * p + translation; }
+        Vec3<T> vector(const Vec3<T> &v) const { return linear * v; }
+
+        // A normal of a surface transformed by the inverse of this transform
+        Vec3<T> normalOfInverse(const Vec3<T> &n) const { return (linear.transpose() * n).normalise(); }
+
+        Transform inverse() const
+        {
+            Mat3<T> inv = linear.inverse();
+            return Transform<T>(inv, (inv * translation) * -1);
+        }
+
+        // This transform applied after the other one
+        Transform operator*(const Transform &other) const
+        {
+            return Transform<T>(linear * other.linear, linear * other.translation + translation);
+        }
+
+        static Transform translate(const Vec3<T> &offset) { return Transform<T>(Mat3Identity<T>(), offset); }
+        static Transform scale(T x, T y, T z) { return Transform<T>(Mat3<T>(x, 0, 0, 0, y, 0, 0, 0, z), Vec3<T>()); }
+
+        // Rotations by the given radians about the x, y and z axis
+        static Transform rotateX(T a) { return Transform<T>(Mat3<T>(1, 0, 0, 0, cos(a), sin(a), 0, -sin(a), cos(a)), Vec3<T>()); }
+        static Transform rotateY(T a) { return Transform<T>(Mat3<T>(cos(a), 0, -sin(a), 0, 1, 0, sin(a), 0, cos(a)), Vec3<T>()); }
+        static Transform rotateZ(T a) { return Transform<T>(Mat3<T>(cos(a), sin(a), 0, -sin(a), cos(a), 0, 0, 0, 1), Vec3<T>()); }
+};
+
 #endif
\ No newline at end of file
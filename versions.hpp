@@ -0,0 +1,53 @@
+#ifndef VERSIONS_HPP
+#define VERSIONS_HPP
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "world.hpp"
+
+// The versions of a world edited while it is traced, read-copy-update
+// style: a frame pins the current version and traces that one to the end,
+// an edit changes a clone and publishes it as the next version. Tracing
+// never waits on an edit, nor an edit on tracing. A version is deleted once
+// it is no longer current and no frame holds it, by whichever lets go last.
+//
+// A clone shares the tables of its version until it changes them, so an
+// edit copies what it touches and no more. Objects added through
+// addWorldObject, surfaces and meshes are shared by all versions, so an
+// edit never changes them in place: a surface is replaced by a changed
+// clone through World::setSurface, objects of the store are moved through
+// World::moveSphere and setTransform, and the geometry of a WorldObject
+// stays as it is.
+class WorldVersions
+{
+private:
+	std::shared_ptr<const World> current;
+	std::mutex editing;	// one edit at a time, never held by a frame
+	std::atomic<long> number;
+
+public:
+	WorldVersions(const std::shared_ptr<const World> & first) : current(first), number(0) {}
+
+	// The current version, unchanged for as long as it is held.
+	std::shared_ptr<const World> pin() const { return std::atomic_load(&current); }
+
+	// Counts the versions published so far.
+	long version() const { return number.load(); }
+
+	// Calls change(world) on a clone of the current version, brings its
+	// acceleration structure up to date and publishes it.
+	template <class Change> void edit(Change change) {
+
+		std::lock_guard<std::mutex> guard(editing);
+
+		World * next = pin()->clone();
+		change(*next);
+		next->update();
+
+		std::atomic_store(&current, std::shared_ptr<const World>(next));
+		number++;
+	}
+};
+
+#endif
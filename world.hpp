@@ -3,8 +3,20 @@
 
 #include <vector>
 #include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include "vec3.hpp"
 #include "ray.hpp"
+#include "bvh.hpp"
+#include "simd.hpp"
+#include "primitives.hpp"
+#include "mesh.hpp"
+#include "stats.hpp"
 
 
 class Light
@@ -19,23 +31,58 @@ public:
 	}
 };
 
-class WorldObject
+// Everything the shading code needs to know about the closest hit of a ray.
+class Hit
+{
+public:
+	float t;
+	int object;
+	int part;	// the triangle hit on a mesh, -1 on other objects
+	Vec3<float> point;
+	Vec3<float> normal;
+
+	Hit() : t(-1.0f), object(-1), part(-1) {}
+};
+
+// What the shading of a primary hit depends on besides the viewpoint: the
+// hit object, point and normal, and which lights reach it (bit i for light
+// i). The surface is looked up through the object when shading, so a frame
+// of records is a G-buffer: it can be shaded again from another viewpoint,
+// or after lights and surfaces changed, without tracing the primary rays
+// again.
+class ShadingRecord
+{
+public:
+	Vec3<float> point;
+	Vec3<float> normal;
+	int object;
+	unsigned lit;
+
+	ShadingRecord() : object(-1), lit(0) {}
+};
+
+// Owned through retain() and release() by the Worlds it was added to, the
+// versions of a world share it (see WorldVersions).
+class WorldObject : public Shared
 {
 public:
 	Surface * surf;
 
-	WorldObject(Surface * _surf) : surf(_surf) {};
+	WorldObject(Surface * _surf) : surf(_surf) {
+		surf->retain();
+	};
 	virtual ~WorldObject() {
-		delete surf;
+		surf->release();
 	}
 	Surface * surface() { return surf; };
+	virtual bool bounded() const { return false; }
+	virtual AABB bounds() const { return AABB(); }
 	virtual float distance(const Ray & ray) const = 0;
-	virtual Vec3<float> normal(const Ray & ray) const = 0;
-	virtual Vec3<float> intersection(const Ray & ray) const {
+	virtual Vec3<float> normal(const Vec3<float> & point) const = 0;
 
-		float dist = distance(ray);
-		return ray.origin + (ray.direction * dist);
-	}
+	// Adds the object to the store the World traces, returns its id there.
+	// Types the store does not know stay behind their virtual interface.
+	virtual int compile(PrimitiveStore & store) { return store.addObject(this); }
 };
 
 class WO_Plane : public WorldObject
@@ -50,17 +97,20 @@ public:
 
 	}
 
-	virtual float distance(const Ray & ray) const {
+	const Vec3<float> & getPoint() const { return point; }
+	const Vec3<float> & getNormal() const { return norm; }
 
-		if (ray.direction.dotProduct(norm) == 0.0f)
-			return -1.0f;
+	virtual float distance(const Ray & ray) const {
 
-		return -norm.dotProduct(ray.origin - point) / norm.dotProduct(ray.direction);
+		return intersectPlane(SimdRay(ray.origin, ray.direction), 
+			point.getX(), point.getY(), point.getZ(), 
+			norm.getX(), norm.getY(), norm.getZ());
 	}
-	virtual Vec3<float> normal(const Ray & ray) const {
+	virtual Vec3<float> normal(const Vec3<float> & point) const {
 		
 		return norm; 
 	}
+	virtual int compile(PrimitiveStore & store) { return store.addPlane(point, norm); }
 };
 
 class WO_Sphere : public WorldObject
@@ -75,35 +125,76 @@ public:
 
 	}
 
+	const Vec3<float> & getOrigin() const { return origin; }
+	float getRadius() const { return radius; }
+
+	virtual bool bounded() const { return true; }
+	virtual AABB bounds() const {
+
+		Vec3<float> r(radius, radius, radius);
+		return AABB(origin - r, origin + r);
+	}
+
 	virtual float distance(const Ray & ray) const {
 
-		float dist;
-		float a = ray.direction.length2();
-		float b = 2 * ray.direction.dotProduct(ray.origin - origin);
-		float c = (ray.origin - origin).length2() - radius * radius;
+		return intersectSphere(SimdRay(ray.origin, ray.direction), 
+			origin.getX(), origin.getY(), origin.getZ(), radius * radius);
+	}
+	virtual Vec3<float> normal(const Vec3<float> & point) const {
 
-		float tmp = b * b - 4 * a * c;
-		if (tmp < 0.0f)
-			return -1.0f;
+		return (point - origin).normalise();
+	}
+	virtual int compile(PrimitiveStore & store) { return store.addSphere(origin, radius); }
+};
 
-		if (-b + sqrt(tmp) < 0.0f)
-			return -1.0f;
+// A triangle mesh, which may be shared with other objects, placed by a
+// transform. With a transform other than the identity it is an instance:
+// rays are taken into the space of the mesh instead of the mesh being
+// copied into the world.
+class WO_Mesh : public WorldObject
+{
+private:
+	const std::shared_ptr<const TriangleMesh> mesh;
+	const Transform<float> transform;
+	const Transform<float> toMesh;
+	const bool identity;
 
-		if (-b - sqrt(tmp) > 0.0f)
-			dist = (-b - sqrt(tmp)) / a / 2;
-		else 
-			dist = (-b + sqrt(tmp)) / a / 2;
+public:
+	WO_Mesh(Surface * _surf, const std::shared_ptr<const TriangleMesh> & _mesh, 
+		const Transform<float> & _transform = Transform<float>())
+	: WorldObject(_surf), mesh(_mesh), transform(_transform), toMesh(_transform.inverse())
+	, identity(_transform.isIdentity()) {
 
-		return dist;
 	}
-	virtual Vec3<float> normal(const Ray & ray) const {
 
-		float dist = distance(ray);
+	const TriangleMesh & getMesh() const { return *mesh; }
+	const Transform<float> & getTransform() const { return transform; }
 
-		return (ray.origin + (ray.direction * dist) - origin).normalise();
+	virtual bool bounded() const { return mesh->triangleCount() > 0; }
+	virtual AABB bounds() const { return mesh->bounds(transform); }
+
+	virtual float distance(const Ray & ray) const {
+
+		float t = std::numeric_limits<float>::infinity();
+		unsigned long tests = 0;
+		TriangleMesh::MeshRay r(toMesh.point(ray.origin), toMesh.vector(ray.direction));
+		return mesh->closest(r, 0.0f, t, tests) == -1 ? -1.0f : t;
+	}
+	virtual Vec3<float> normal(const Vec3<float> & point) const {
+
+		return toMesh.normalOfInverse(mesh->normal(mesh->nearest(toMesh.point(point))));
+	}
+	virtual int compile(PrimitiveStore & store) {
+		return identity ? store.addMesh(mesh.get()) : store.addInstance(mesh.get(), toMesh);
 	}
 };
 
+// How World::getColors follows the mirror reflections.
+enum ShadingMode
+{
+	SHADE_RECURSIVE,	// each ray on its own, depth first
+	SHADE_WAVEFRONT	// all rays of one bounce together, bounce by bounce
+};
 
 class World
 {
@@ -114,96 +205,1373 @@ private:
 
 	Color ambientColor;
 
+	// The objects compiled by type, filled as they are added.
+	PrimitiveStore store;
+
+	// The surfaces flattened, one entry per distinct Surface.
+	Table<Material> materials;
+
+	BVH bvh;
+	Table<int> planeIds;
+	Table<int> unbounded;	// the unbounded objects that are not planes
+	bool built;
+
+	// Objects moved since the last update, the position of each object in
+	// bvh.indices or -1, made on the first update, and how much worse than
+	// built refits may make the BVH.
+	std::vector<int> movedIds;
+	Table<int> bvhSlots;
+	float rebuildThreshold;
+
+	// Copies of the spheres in BVH leaf order, leaf entries of other types
+	// never hit, and of the unbounded planes in the order of planeIds.
+	SphereSoA spheres;
+	PlaneSoA planes;
+	bool sphereLeaves;	// all leaf entries are spheres
+
+	ShadingMode shadingMode;
+
+	// Mirror reflections whose share of the pixel color would drop below
+	// minThroughput are not traced, or with roulette traced with
+	// probability share / minThroughput and weighted up.
+	float minThroughput;
+	bool roulette;
+
+	// Orders the rays of a bounce by the object they leave from.
+	struct SourceOrder
+	{
+		const std::vector<int> & sources;
+
+		SourceOrder(const std::vector<int> & _sources) : sources(_sources) {}
+		bool operator()(int a, int b) const { return sources[a] < sources[b]; }
+	};
+
+	// One bounce of a path traced as a wavefront: the shading of its hit,
+	// short of the color reflected there, and the weight of that color.
+	struct PathVertex
+	{
+		int path;
+		Color surface;
+		Color light;
+		float mirror;
+		float weight;
+	};
+
+	// Helper handed to BVH::traverse, keeps the closest hit of the leaves.
+	struct ClosestHit
+	{
+		const World * world;
+		const Ray * ray;
+		SimdRay simdRay;
+		int index;
+		int part;
+		unsigned long tests;
+
+		ClosestHit() {}
+		ClosestHit(const World * _world, const Ray & _ray) 
+		: world(_world), ray(&_ray), simdRay(_ray.origin, _ray.direction), index(-1), part(-1), tests(0) {}
+
+		void test(int obj, float & tMax) {
+
+			if (world->store.isMesh(obj)) {
+				int triangle = world->store.mesh(obj)->closest(world->meshRay(obj, *ray), world->minCastDist, tMax, tests);
+				if (triangle != -1) {
+					index = obj;
+					part = triangle;
+				}
+				return;
+			}
+
+			tests++;
+			float tmpDist = world->distance(obj, *ray, simdRay);
+			if (tmpDist > world->minCastDist && tmpDist < tMax) {
+				tMax = tmpDist;
+				index = obj;
+				part = -1;
+			}
+		}
+
+		void testUnbounded(float & tMax) {
+
+			tests += world->planeIds.size();
+			int slot = world->planes.closest(simdRay, world->minCastDist, tMax);
+			if (slot != -1) {
+				index = world->planeIds[slot];
+				part = -1;
+			}
+
+			for (int i = 0; i < world->unbounded.size(); i++)
+				test(world->unbounded[i], tMax);
+		}
+
+		bool operator()(int start, int count, float & tMax) {
+
+			int slot = world->spheres.closest(start, count, simdRay, world->minCastDist, tMax);
+			if (slot != -1) {
+				index = world->bvh.indices[slot];
+				part = -1;
+			}
+
+			if (world->sphereLeaves) {
+				tests += count;
+				return false;
+			}
+
+			for (int i = start; i < start + count; i++) {
+				if (world->store.type(world->bvh.indices[i]) == PRIM_SPHERE)
+					tests++;
+				else
+					test(world->bvh.indices[i], tMax);
+			}
+			return false;
+		}
+	};
+
+	// Helper handed to BVH::traverse, stops at the first hit before tMax.
+	struct AnyHit
+	{
+		const World * world;
+		const Ray * ray;
+		SimdRay simdRay;
+		bool found;
+		unsigned long tests;
+
+		AnyHit() {}
+		AnyHit(const World * _world, const Ray & _ray) 
+		: world(_world), ray(&_ray), simdRay(_ray.origin, _ray.direction), found(false), tests(0) {}
+
+		bool test(int obj, float tMax) {
+
+			if (world->store.isMesh(obj))
+				return world->store.mesh(obj)->any(world->meshRay(obj, *ray), world->minCastDist, tMax, tests);
+
+			tests++;
+			float tmpDist = world->distance(obj, *ray, simdRay);
+			return tmpDist > world->minCastDist && tmpDist < tMax;
+		}
+
+		bool testUnbounded(float tMax) {
+
+			tests += world->planeIds.size();
+			found = world->planes.any(simdRay, world->minCastDist, tMax);
+
+			for (int i = 0; i < world->unbounded.size() && !found; i++)
+				found = test(world->unbounded[i], tMax);
+			return found;
+		}
+
+		bool operator()(int start, int count, float & tMax) {
+
+			found = world->spheres.any(start, count, simdRay, world->minCastDist, tMax);
+
+			if (world->sphereLeaves) {
+				tests += count;
+				return found;
+			}
+
+			for (int i = start; i < start + count && !found; i++) {
+				if (world->store.type(world->bvh.indices[i]) == PRIM_SPHERE)
+					tests++;
+				else
+					found = test(world->bvh.indices[i], tMax);
+			}
+			return found;
+		}
+	};
+	// Helpers handed to BVH::traversePacket, one scalar helper per lane.
+	struct PacketClosestHit
+	{
+		ClosestHit * lanes;
+		BVHPacket & packet;
+
+		PacketClosestHit(ClosestHit * _lanes, BVHPacket & _packet) : lanes(_lanes), packet(_packet) {}
+
+		unsigned operator()(int start, int count, unsigned mask) {
+
+			for (int i = 0; i < packet.count; i++)
+				if ((mask >> i) & 1)
+					lanes[i](start, count, packet.tMax[i]);
+			return 0;
+		}
+	};
+
+	struct PacketAnyHit
+	{
+		AnyHit * lanes;
+		BVHPacket & packet;
+
+		PacketAnyHit(AnyHit * _lanes, BVHPacket & _packet) : lanes(_lanes), packet(_packet) {}
+
+		unsigned operator()(int start, int count, unsigned mask) {
+
+			unsigned done = 0;
+			for (int i = 0; i < packet.count; i++)
+				if (((mask >> i) & 1) && lanes[i](start, count, packet.tMax[i]))
+					done |= 1u << i;
+			return done;
+		}
+	};
+
+
+	// What the world holds on to besides its tables. The versions made by
+	// clone() share one until a version adds to it, so a clone costs the
+	// same however many objects and surfaces there are.
+	struct Holdings
+	{
+		// The objects added through addWorldObject, the surfaces of the
+		// primitives added without a WorldObject and their meshes.
+		std::vector<WorldObject*> objects;
+		std::vector<Surface*> surfaces;
+		std::unordered_map<const TriangleMesh*, std::shared_ptr<const TriangleMesh> > meshes;
+
+		// The Surface of each entry of the material table.
+		std::vector<Surface*> materialSurfaces;
+		std::unordered_map<const Surface*, int> materialIds;
+
+		Holdings() {}
+		Holdings(const Holdings & other)
+		: objects(other.objects), surfaces(other.surfaces), meshes(other.meshes)
+		, materialSurfaces(other.materialSurfaces), materialIds(other.materialIds) {
+
+			for (int i = 0; i < objects.size(); i++)
+				objects[i]->retain();
+			for (int i = 0; i < surfaces.size(); i++)
+				surfaces[i]->retain();
+			for (int i = 0; i < materialSurfaces.size(); i++)
+				materialSurfaces[i]->retain();
+		}
+		~Holdings() {
+
+			for (int i = 0; i < objects.size(); i++)
+				objects[i]->release();
+			for (int i = 0; i < surfaces.size(); i++)
+				surfaces[i]->release();
+			for (int i = 0; i < materialSurfaces.size(); i++)
+				materialSurfaces[i]->release();
+		}
+	};
+	std::shared_ptr<Holdings> held;
+
+	// The holdings to add to, copied first if another version shares them.
+	Holdings & hold() {
+
+		if (held.use_count() > 1)
+			held = std::make_shared<Holdings>(*held);
+		// as in Table, an older version may just have let go on another thread
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return *held;
+	}
+
+	// What the borrowed tables point into, e.g. a mapped snapshot.
+	std::shared_ptr<const void> backing;
+
+	// Only through clone(), which takes care of what the world holds.
+	World(const World & other) = default;
+	World & operator=(const World & other) = delete;
+
 public:
-	std::vector<WorldObject*> objects;
 	std::vector<Light*> lights;
 
-	World() {
+	// Leaves hold up to two blocks of four spheres, the size of one AVX2 test.
+	World() : bvh(simdBlock, 4), held(std::make_shared<Holdings>()) {
 
 		minCastDist = 0.001f;
 		maxLightError = 0.001f;
 		voidColor = Color(1.0f, 1.0f, 1.0f);
 		ambientColor = Color(1.0f, 1.0f, 1.0f);
 
+		built = false;
+		rebuildThreshold = 1.5f;
+		sphereLeaves = false;
+		shadingMode = SHADE_WAVEFRONT;
+		minThroughput = 0.0f;
+		roulette = false;
 	}
 	~World() {
-		for (int i = 0; i < objects.size(); i++)
-			delete objects[i];
-
 		for (int i = 0; i < lights.size(); i++)
 			delete lights[i];
 	}
 
+	// A copy to be changed while this world is traced. The tables and the
+	// holdings are shared until one of the two changes them, the lights are
+	// copied.
+	World * clone() const {
+
+		World * copy = new World(*this);
+		for (int i = 0; i < lights.size(); i++)
+			copy->lights[i] = new Light(*lights[i]);
+		return copy;
+	}
+
+	// The objects added through addWorldObject. Object ids count these and
+	// the primitives added directly together, in the order of adding.
+	const std::vector<WorldObject*> & getObjects() const { return held->objects; }
+
 	void addWorldObject(WorldObject * wo) {
-		objects.push_back(wo);
+		wo->retain();
+		hold().objects.push_back(wo);
+		int id = wo->compile(store);
+		store.setMaterial(id, addMaterial(wo->surface()));
+		built = false;
+	}
+
+	// Primitives that go straight into the store, for scenes too large for
+	// an object on the heap per primitive. They return the object id. The
+	// World holds the surface, which may be shared, until it is gone.
+	int addSphere(Surface * surface, const Vec3<float> & center, float radius) {
+
+		int id = store.addSphere(center, radius);
+		store.setMaterial(id, addMaterial(surface));
+		built = false;
+		return id;
+	}
+
+	int addPlane(Surface * surface, const Vec3<float> & point, const Vec3<float> & normal) {
+
+		int id = store.addPlane(point, normal.normalise());
+		store.setMaterial(id, addMaterial(surface));
+		built = false;
+		return id;
+	}
+
+	int addMesh(Surface * surface, const std::shared_ptr<const TriangleMesh> & mesh) {
+
+		hold().meshes[mesh.get()] = mesh;
+		int id = store.addMesh(mesh.get());
+		store.setMaterial(id, addMaterial(surface));
+		built = false;
+		return id;
+	}
+
+	// The mesh placed by transform, sharing its triangles with every other
+	// instance of it.
+	int addInstance(Surface * surface, const std::shared_ptr<const TriangleMesh> & mesh, const Transform<float> & transform) {
+
+		hold().meshes[mesh.get()] = mesh;
+		int id = store.addInstance(mesh.get(), transform.inverse());
+		store.setMaterial(id, addMaterial(surface));
+		built = false;
+		return id;
+	}
+
+	// Moving objects between frames: the store changes at once, the
+	// acceleration structure with the next update(), which has to come
+	// before tracing again. A sphere added through a WO_Sphere keeps its
+	// old place there, tracing reads the store. Both return false, changing
+	// nothing, if obj is not of their type.
+	bool moveSphere(int obj, const Vec3<float> & center, float radius) {
+
+		if (!store.setSphere(obj, center, radius))
+			return false;
+		moved(obj);
+		return true;
+	}
+
+	// Places mesh or instance obj by transform.
+	bool setTransform(int obj, const Transform<float> & transform) {
+
+		if (!store.setInstance(obj, transform.inverse()))
+			return false;
+		moved(obj);
+		return true;
+	}
+
+	// After the geometry of an object of a type the store does not know
+	// changed.
+	void moved(int obj) { movedIds.push_back(obj); }
+
+	// Refits the BVH to the objects moved since the last update or build,
+	// from their leaves up, so the cost grows with the number of them and
+	// not with the size of the scene. Once the refits have made tracing
+	// worse than the threshold times the built BVH by the surface area
+	// heuristic, or an object came into or out of bounds, it builds anew.
+	void update() {
+
+		if (!built) {
+			build();
+			return;
+		}
+		if (movedIds.empty())
+			return;
+
+		const Table<int> & leafIds = bvh.indices;
+		if (bvhSlots.empty()) {
+			bvhSlots.assign(store.size(), -1);
+			for (int i = 0; i < leafIds.size(); i++)
+				bvhSlots[leafIds[i]] = i;
+		}
+
+		const Table<int> & slots = bvhSlots;
+		for (int i = 0; i < movedIds.size(); i++) {
+
+			int obj = movedIds[i];
+			int slot = slots[obj];
+			if ((slot != -1) != bounded(obj)) {
+				build();
+				return;
+			}
+			if (slot == -1)
+				continue;
+
+			if (store.type(obj) == PRIM_SPHERE)
+				spheres.set(slot, store.sphere(obj).center, store.sphere(obj).radius);
+			bvh.refit(slot, ObjectBounds(this));
+		}
+		movedIds.clear();
+
+		if (bvh.degradation() > rebuildThreshold)
+			build();
+	}
+
+	// 1.5 by default. Lower keeps tracing closer to the speed of a built BVH
+	// at the cost of more frequent builds.
+	void setRebuildThreshold(float threshold) { rebuildThreshold = threshold; }
+
+	// How many times the cost of tracing the built BVH refits have made it,
+	// by the surface area heuristic.
+	double getDegradation() const { return bvh.degradation(); }
+
+	// Holds the surface until the World is gone, also if no object uses it.
+	Surface * addSurface(Surface * surface) {
+
+		surface->retain();
+		hold().surfaces.push_back(surface);
+		return surface;
+	}
+
+	int objectCount() const { return store.size(); }
+
+	// The triangles of all meshes and the bytes they take, a mesh added
+	// more than once is counted once, and the number of instances.
+	void meshStats(long & triangles, size_t & bytes, long & instances) const {
+
+		std::unordered_set<const TriangleMesh*> seen;
+		triangles = 0;
+		bytes = 0;
+		instances = 0;
+		for (int i = 0; i < store.size(); i++) {
+			if (!store.isMesh(i))
+				continue;
+			instances += store.type(i) == PRIM_INSTANCE;
+			if (!seen.insert(store.mesh(i)).second)
+				continue;
+			triangles += store.mesh(i)->triangleCount();
+			bytes += store.mesh(i)->memory();
+		}
+	}
+	Surface * getSurface(int obj) const { return held->materialSurfaces[store.material(obj)]; }
+
+	// Replaces the surface of object obj, and so of every object sharing
+	// it, e.g. with a changed clone of it. Versions of the world made
+	// before go on with the old one.
+	void setSurface(int obj, Surface * surface) {
+
+		int m = store.material(obj);
+		Holdings & holdings = hold();
+		Surface * old = holdings.materialSurfaces[m];
+
+		surface->retain();
+		holdings.materialIds.erase(old);
+		holdings.materialSurfaces[m] = surface;
+		holdings.materialIds[surface] = m;
+		old->release();
+
+		Material material;
+		surface->flatten(material);
+		materials[m] = material;
+	}
+
+	int addMaterial(Surface * surface) {
+
+		std::unordered_map<const Surface*, int>::const_iterator found = held->materialIds.find(surface);
+		if (found != held->materialIds.end())
+			return found->second;
+
+		surface->retain();
+		Material material;
+		surface->flatten(material);
+		materials.push_back(material);
+		hold().materialSurfaces.push_back(surface);
+		hold().materialIds[surface] = materials.size() - 1;
+		return materials.size() - 1;
+	}
+
+	// Flattens the surfaces again after they were changed. build() does too.
+	// Only changed materials are written, so a borrowed table stays so.
+	void updateMaterials() {
+
+		const std::vector<Surface*> & surfaces = held->materialSurfaces;
+		for (int i = 0; i < surfaces.size(); i++) {
+			Material material;
+			surfaces[i]->flatten(material);
+			const Material & current = static_cast<const Table<Material>&>(materials)[i];
+			if (memcmp(&material, &current, sizeof(Material)) != 0)
+				materials[i] = material;
+		}
+	}
+
+	bool isBuilt() const { return built; }
+
+	// Whether all of the world lies in its tables: no mesh or instance, no
+	// WorldObject of a type the store does not know and no MAT_VIRTUAL
+	// surface.
+	bool inTables() const {
+
+		if (store.meshCount() != 0 || store.instanceCount() != 0 || store.objectCount() != 0)
+			return false;
+		for (int i = 0; i < materials.size(); i++)
+			if (materials[i].features & MAT_VIRTUAL)
+				return false;
+		return true;
+	}
+
+	// Every table tracing and shading read once the world is built, always
+	// in the same order. See snapshot.hpp.
+	template <class Visitor> void visitTables(Visitor & visit) {
+
+		store.visitTables(visit);
+		visit(materials);
+		bvh.visitTables(visit);
+		visit(planeIds);
+		visit(unbounded);
+		spheres.visitTables(visit);
+		planes.visitTables(visit);
+	}
+
+	// Whether tables filled through visitTables, e.g. from a file, index
+	// only within each other and hold materials as flatten() makes them, so
+	// tracing them stays in bounds and comes to an end.
+	bool validTables() const {
+
+		if (!store.valid(materials.size()) || !bvh.valid(store.size())
+			|| !spheres.valid(bvh.indices.size()) || !planes.valid(planeIds.size()))
+			return false;
+		for (int i = 0; i < planeIds.size(); i++)
+			if (planeIds[i] < 0 || planeIds[i] >= store.size() || store.type(planeIds[i]) != PRIM_PLANE)
+				return false;
+		for (int i = 0; i < unbounded.size(); i++)
+			if (unbounded[i] < 0 || unbounded[i] >= store.size())
+				return false;
+		// as flatten() leaves them, a world in tables has no MAT_VIRTUAL
+		for (int i = 0; i < materials.size(); i++) {
+			const Material & material = materials[i];
+			if ((material.features & ~(unsigned)(MAT_MIRROR | MAT_PATTERN | MAT_SMALL_EXPONENT)) != 0)
+				return false;
+			if ((material.features & MAT_SMALL_EXPONENT) && (material.phong < 0 || material.phong > 64))
+				return false;
+		}
+		return true;
+	}
+
+	// Completes a world whose tables were all filled through visitTables,
+	// as built. backing is kept alive as long as the world. Every material
+	// gets a Surface again, so getSurface and updateMaterials work as usual.
+	void adoptTables(const std::shared_ptr<const void> & _backing) {
+
+		backing = _backing;
+
+		for (int i = 0; i < materials.size(); i++) {
+			const Material & material = static_cast<const Table<Material>&>(materials)[i];
+			Surface * surface = material.features & MAT_PATTERN ? new S_Pattern() : new Surface();
+			surface->retain();
+			surface->setColor(material.color);
+			surface->setShadingModel(material.ambient, material.diffuse, material.specular);
+			surface->setPhongModel(material.phong);
+			surface->setMirror(material.mirror);
+			hold().materialSurfaces.push_back(surface);
+			hold().materialIds[surface] = i;
+		}
+
+		sphereLeaves = store.sphereCount() == bvh.indices.size();
+		built = true;
+	}
+
+	// Builds the acceleration structure. Until it is called (again) after
+	// adding objects, castRay falls back to testing every object.
+	void build() {
+
+		std::vector<AABB> boxes;
+		std::vector<int> ids;
+		planeIds.clear();
+		unbounded.clear();
+		movedIds.clear();
+		bvhSlots.clear();
+		int sphereCount = 0;
+
+		for (int i = 0; i < store.size(); i++) {
+			if (bounded(i)) {
+				boxes.push_back(bounds(i));
+				ids.push_back(i);
+				sphereCount += store.type(i) == PRIM_SPHERE;
+			}
+			else if (store.type(i) == PRIM_PLANE) {
+				planeIds.push_back(i);
+			}
+			else {
+				unbounded.push_back(i);
+			}
+		}
+
+		// Leaves of two blocks suit the vector test of spheres. Meshes and
+		// instances take a traversal of their own each, they do better in
+		// leaves of four tested one by one.
+		if (2 * sphereCount >= boxes.size())
+			bvh.setLeaves(simdBlock, 4);
+		else
+			bvh.setLeaves(4, 1);
+		bvh.build(boxes, ids);
+
+		sphereLeaves = true;
+		spheres.resize(bvh.indices.size());
+		for (int i = 0; i < bvh.indices.size(); i++) {
+			if (store.type(bvh.indices[i]) == PRIM_SPHERE) {
+				const PrimitiveStore::Sphere & sphere = store.sphere(bvh.indices[i]);
+				spheres.set(i, sphere.center, sphere.radius);
+			}
+			else {
+				spheres.exclude(i);
+				sphereLeaves = false;
+			}
+		}
+
+		planes.resize(planeIds.size());
+		for (int i = 0; i < planeIds.size(); i++) {
+			const PrimitiveStore::Plane & plane = store.plane(planeIds[i]);
+			planes.set(i, plane.point, plane.normal);
+		}
+
+		updateMaterials();
+		built = true;
+	}
+
+	// Static dispatch over the store, only objects of types it does not know
+	// are asked through their virtual interface.
+	float distance(int obj, const Ray & ray, const SimdRay & r) const {
+
+		if (store.isMesh(obj)) {
+			float t = std::numeric_limits<float>::infinity();
+			unsigned long tests = 0;
+			return store.mesh(obj)->closest(meshRay(obj, ray), minCastDist, t, tests) == -1 ? -1.0f : t;
+		}
+		if (store.type(obj) == PRIM_OBJECT)
+			return store.object(obj)->distance(ray);
+		return store.distance(obj, r);
+	}
+
+	// The ray in the space of a mesh or instance. Its direction keeps the
+	// length the transform gives it, so distances along it are those along
+	// the ray.
+	TriangleMesh::MeshRay meshRay(int obj, const Ray & ray) const {
+
+		if (store.type(obj) == PRIM_INSTANCE) {
+			const Transform<float> & toMesh = store.instance(obj).toMesh;
+			return TriangleMesh::MeshRay(toMesh.point(ray.origin), toMesh.vector(ray.direction));
+		}
+		return TriangleMesh::MeshRay(ray.origin, ray.direction);
+	}
+
+	// part is the triangle hit on a mesh.
+	Vec3<float> normal(int obj, int part, const Vec3<float> & point) const {
+
+		if (store.type(obj) == PRIM_MESH)
+			return store.mesh(obj)->normal(part);
+		if (store.type(obj) == PRIM_INSTANCE)
+			return store.instance(obj).toMesh.normalOfInverse(store.mesh(obj)->normal(part));
+		if (store.type(obj) == PRIM_OBJECT)
+			return store.object(obj)->normal(point);
+		return store.normal(obj, point);
+	}
+
+	// Helper handed to BVH::refit.
+	struct ObjectBounds
+	{
+		const World * world;
+
+		ObjectBounds(const World * _world) : world(_world) {}
+		AABB operator()(int obj) const { return world->bounds(obj); }
+	};
+
+	bool bounded(int obj) const {
+
+		PrimitiveType type = store.type(obj);
+		return type == PRIM_SPHERE || (store.isMesh(obj) && store.mesh(obj)->triangleCount() > 0)
+			|| (type == PRIM_OBJECT && store.object(obj)->bounded());
+	}
+
+	AABB bounds(int obj) const {
+
+		if (store.type(obj) == PRIM_MESH)
+			return store.mesh(obj)->bounds();
+		if (store.type(obj) == PRIM_INSTANCE)
+			return store.mesh(obj)->bounds(store.instance(obj).toMesh.inverse());
+		if (store.type(obj) == PRIM_OBJECT)
+			return store.object(obj)->bounds();
+
+		const PrimitiveStore::Sphere & sphere = store.sphere(obj);
+		Vec3<float> r(sphere.radius, sphere.radius, sphere.radius);
+		return AABB(sphere.center - r, sphere.center + r);
 	}
 
 	void addLight(Light * l) {
 		lights.push_back(l);
 	}
 
-	Color getColor(const Ray & ray, int depth = 0) const {
+	// Replaces light i, e.g. to change its color or move it.
+	void setLight(int i, Light * l) {
+		delete lights[i];
+		lights[i] = l;
+	}
+
+	// Mirror reflections are followed up to this depth.
+	enum { maxDepth = 10 };
+
+	ShadingMode getShadingMode() const { return shadingMode; }
+	void setShadingMode(ShadingMode mode) { shadingMode = mode; }
+
+	// The quality knob: reflections are followed until their share of the
+	// pixel color drops below threshold, so no channel of a pixel is off by
+	// more than about threshold. 0 follows them to maxDepth. With roulette
+	// some of them go on at a higher weight instead. Colors clamp at 1 at
+	// every bounce, which cuts the weighted up survivors short, so roulette
+	// is biased low besides adding noise.
+	void setTermination(float threshold, bool _roulette) {
+		minThroughput = threshold;
+		roulette = _roulette;
+	}
+	float getMinThroughput() const { return minThroughput; }
+	bool getRoulette() const { return roulette; }
+
+	Color getColor(const Ray & ray, int depth = 0, float throughput = 1.0f) const {
 
-		if (depth > 10) { 
+		if (depth > maxDepth) { 
 			return voidColor;
 		}
 
-		int obj = castRay(ray);
-		if (obj == -1)
+		countStat(depth == 0 ? STAT_PRIMARY_RAYS : STAT_REFLECTION_RAYS);
+		countDepth(depth);
+
+		Hit hit;
+		if (!castRay(ray, hit))
 			return voidColor;
 
-		Vec3<float> inter = objects[obj]->intersection(ray);
-		Vec3<float> norm = objects[obj]->normal(ray);
-		Surface * surf = objects[obj]->surface();
+		return shade(ray, hit, NULL, depth, throughput);
+	}
 
-		Color lightColor = ambientColor * surf->getAmbient();
+	// Shades a hit of the ray. lit holds for every light whether it reaches
+	// the hit point, when NULL the shadow rays are cast here. throughput is
+	// the share of the pixel color the hit makes up.
+	Color shade(const Ray & ray, const Hit & hit, const unsigned char * lit, int depth, float throughput = 1.0f) const {
 
-		for (int i = 0; i < lights.size(); i++) {
+		Color lightColor;
+		Color surfaceColor;
+		float mir;
+		shadeSurface(ray, hit, lit, surfaceColor, lightColor, mir);
 
-			Vec3<float> lightDir = (inter - lights[i]->origin).normalise();
-			Ray lightRay(lights[i]->origin, lightDir);
+		if (mir != 0.0f) {
+			float weight = mir;
+			float next = throughput * mir;
+			Color mirrorColor = voidColor;
+
+			// past the depth limit the reflection is never traced
+			if (depth >= maxDepth)
+				;
+			else if (follow(hit, depth, weight, next))
+				mirrorColor = getColor(reflect(ray, hit), depth + 1, next);
+			else if (roulette)
+				mirrorColor = Color();
+
+			surfaceColor = surfaceColor * (1 - mir) + mirrorColor * weight;
+		}
 
-			int lightObj = castRay(lightRay);
-			if (lightObj == -1 || lightObj != obj)
+		return surfaceColor.intersect(lightColor);
+	}
+
+	// The shading of a hit short of its mirror reflection: the color of the
+	// surface, the light reaching it, lit as for shade(), and how much of
+	// the reflected color shows. Each combination of material features has
+	// its own kernel, only MAT_VIRTUAL surfaces are asked through their
+	// getters.
+	void shadeSurface(const Ray & ray, const Hit & hit, const unsigned char * lit, Color & surface, Color & light, float & mirror) const {
+
+		const Material & material = materials[store.material(hit.object)];
+
+		switch (material.features) {
+		case 0: return shadeMaterial<0>(ray, hit, material, lit, surface, light, mirror);
+		case 1: return shadeMaterial<1>(ray, hit, material, lit, surface, light, mirror);
+		case 2: return shadeMaterial<2>(ray, hit, material, lit, surface, light, mirror);
+		case 3: return shadeMaterial<3>(ray, hit, material, lit, surface, light, mirror);
+		case 4: return shadeMaterial<4>(ray, hit, material, lit, surface, light, mirror);
+		case 5: return shadeMaterial<5>(ray, hit, material, lit, surface, light, mirror);
+		case 6: return shadeMaterial<6>(ray, hit, material, lit, surface, light, mirror);
+		case 7: return shadeMaterial<7>(ray, hit, material, lit, surface, light, mirror);
+		}
+
+		const Surface * surf = held->materialSurfaces[store.material(hit.object)];
+		Material current;
+		surf->flatten(current);
+
+		light = lighting<0>(ray, hit, current, lit);
+		surface = surf->getColor(hit.point);
+		mirror = surf->getMirror(hit.point);
+	}
+
+	template <unsigned features>
+	void shadeMaterial(const Ray & ray, const Hit & hit, const Material & material, const unsigned char * lit, 
+		Color & surface, Color & light, float & mirror) const {
+
+		light = lighting<features>(ray, hit, material, lit);
+		surface = features & MAT_PATTERN ? patternColor(material.color, hit.point) : material.color;
+		mirror = features & MAT_MIRROR ? material.mirror : 0.0f;
+	}
+
+	// x^n by squaring, in double like pow.
+	static double powSmall(double x, int n) {
+
+		double result = 1.0;
+		for (; n; n >>= 1, x *= x)
+			if (n & 1)
+				result *= x;
+		return result;
+	}
+
+	// Whether to trace the mirror reflection of a hit whose reflected
+	// color makes up next of the pixel color, short of the depth limit which
+	// the callers check first. A reflection left out sees the void, or
+	// nothing with roulette, where the ones that go on weigh more, clamped
+	// like any color.
+	bool follow(const Hit & hit, int depth, float & weight, float & next) const {
+
+		if (next >= minThroughput)
+			return true;
+
+		if (roulette) {
+			float chance = next / minThroughput;
+			if (rouletteSample(hit.point, depth) < chance) {
+				weight /= chance;
+				next = minThroughput;
+				return true;
+			}
+		}
+
+		countStat(STAT_TERMINATED_PATHS);
+		return false;
+	}
+
+	// A number in [0, 1) that only depends on the hit, so both shading
+	// modes and every run make the same choices.
+	static float rouletteSample(const Vec3<float> & point, int depth) {
+
+		float coords[3] = { point.getX(), point.getY(), point.getZ() };
+		uint32_t bits[3];
+		memcpy(bits, coords, sizeof(bits));
+
+		uint32_t h = 2166136261u ^ (uint32_t)depth;
+		for (int i = 0; i < 3; i++) {
+			h = (h ^ bits[i]) * 16777619u;
+			h ^= h >> 15;
+		}
+		h *= 0x2c1b3c6du;
+		h ^= h >> 12;
+		return (h >> 8) * (1.0f / 16777216.0f);
+	}
+
+	Ray reflect(const Ray & ray, const Hit & hit) const {
+
+		const Vec3<float> & norm = hit.normal;
+		return Ray(hit.point, norm * (-2 * norm.dotProduct(ray.direction)) + ray.direction);
+	}
+
+	// The ambient light plus the diffuse and specular light of every light
+	// that reaches the hit, lit as for shade().
+	template <unsigned features>
+	Color lighting(const Ray & ray, const Hit & hit, const Material & material, const unsigned char * lit) const {
+
+		const Vec3<float> & inter = hit.point;
+		const Vec3<float> & norm = hit.normal;
+
+		Color lightColor = ambientColor * material.ambient;
+
+		for (int i = 0; i < lights.size(); i++) {
+
+			if (lit ? !lit[i] : occluded(lights[i]->origin, inter))
 				continue;
 
+			Vec3<float> lightDir = (inter - lights[i]->origin).normalise();
+
 			// diffuse
 			float diffusion = fmax(0.0f, -norm.dotProduct(lightDir));
-			lightColor += lights[i]->color * (surf->getDiffuse() * diffusion);
+			lightColor += lights[i]->color * (material.diffuse * diffusion);
 
 			// specular
 			Vec3<float> bisector = (ray.direction + lightDir).normalise();
-			float specular = pow(fmax(0.0f, -norm.dotProduct(bisector)), surf->getPhongModel());
+			float highlight = fmax(0.0f, -norm.dotProduct(bisector));
+			float specular = features & MAT_SMALL_EXPONENT ? powSmall(highlight, material.phong) : pow(highlight, material.phong);
 	
-			lightColor += lights[i]->color * (surf->getSpecular() * specular);
+			lightColor += lights[i]->color * (material.specular * specular);
 			
 		}
 
-		float mir = surf->getMirror(inter);
-		Color surfaceColor;
+		return lightColor;
+	}
 
-		if (mir != 0.0f) {
-			Vec3<float> reflectionDir = norm * (-2 * norm.dotProduct(ray.direction)) + ray.direction;
-			Color mirrorColor = getColor(Ray(inter, reflectionDir), ++depth);
+	int castRay(const Ray & ray) const {
+
+		float tMax = std::numeric_limits<float>::infinity();
+		int part;
+		return closestObject(ray, tMax, part);
+	}
+
+	// Finds the closest object along the ray and fills in the hit record,
+	// the hit point and normal are only computed for that one object.
+	bool castRay(const Ray & ray, Hit & hit) const {
+
+		float tMax = std::numeric_limits<float>::infinity();
+		int part;
+		int obj = closestObject(ray, tMax, part);
+		return fillHit(ray, obj, part, tMax, hit);
+	}
+
+	bool fillHit(const Ray & ray, int obj, int part, float t, Hit & hit) const {
+
+		hit.object = obj;
+		hit.part = part;
+		if (obj == -1)
+			return false;
+
+		hit.t = t;
+		hit.point = ray.origin + (ray.direction * t);
+		hit.normal = normal(obj, part, hit.point);
+		return true;
+	}
+
+	// getColor for many rays, in the way the shading mode asks for. When
+	// records is given it receives a ShadingRecord per ray. Both modes give
+	// the very same colors.
+	void getColors(const Ray * rays, int count, Color * colors, ShadingRecord * records = NULL) const {
+
+		if (shadingMode == SHADE_WAVEFRONT)
+			getColorsWavefront(rays, count, colors, records);
+		else
+			getColorsRecursive(rays, count, colors, records);
+	}
+
+	// Shades up to BVHPacket::capacity rays at a time. Primary rays and the
+	// shadow rays toward each light are traced as packets, mirror
+	// reflections continue ray by ray.
+	void getColorsRecursive(const Ray * rays, int count, Color * colors, ShadingRecord * records = NULL) const {
+
+		std::vector<unsigned char> lit(BVHPacket::capacity * lights.size());
+		Vec3<float> targets[BVHPacket::capacity];
+		Hit hits[BVHPacket::capacity];
+
+		for (int base = 0; base < count; base += BVHPacket::capacity) {
+
+			int n = std::min<int>(BVHPacket::capacity, count - base);
+			countStat(STAT_PRIMARY_RAYS, n);
+			countDepth(0, n);
+			castPacket(rays + base, n, hits);
+
+			unsigned mask = 0;
+			for (int i = 0; i < n; i++) {
+				if (hits[i].object != -1)
+					mask |= 1u << i;
+				targets[i] = hits[i].point;
+			}
+
+			for (int l = 0; l < lights.size(); l++) {
+				unsigned blocked = occludedPacket(lights[l]->origin, targets, n, mask);
+				for (int i = 0; i < n; i++)
+					lit[i * lights.size() + l] = !((blocked >> i) & 1);
+			}
+
+			for (int i = 0; i < n; i++) {
+				if (hits[i].object == -1)
+					colors[base + i] = voidColor;
+				else
+					colors[base + i] = shade(rays[base + i], hits[i], &lit[i * lights.size()], 0);
+			}
+
+			for (int i = 0; records && i < n; i++)
+				record(hits[i], &lit[i * lights.size()], records[base + i]);
+		}
+	}
+
+	// Traces the rays as a wavefront, one bounce after the other. The rays
+	// of a bounce are cast, then the shadow rays of all their hits toward
+	// each light, then the hits are shaded and their mirror reflections
+	// make up the next bounce. Rays that leave or end on the same object
+	// are coherent enough for packets, the others go one by one.
+	// Colors are clamped, so the color of a hit is not linear in the color
+	// reflected there; each bounce keeps a PathVertex per path and the
+	// colors are put together backwards, from the deepest bounce up, as
+	// getColor would.
+	void getColorsWavefront(const Ray * rays, int count, Color * colors, ShadingRecord * records = NULL) const {
+
+		std::vector<Ray> queue(rays, rays + count);
+		std::vector<Ray> reflected;
+		std::vector<int> paths(count);
+		std::vector<int> reflectedPaths;
+		std::vector<int> sources(count, -1);
+		std::vector<int> reflectedSources;
+		std::vector<float> throughputs(count, 1.0f);
+		std::vector<float> reflectedThroughputs;
+		std::vector<int> order;
+		std::vector<Hit> hits;
+		std::vector<Vec3<float> > targets;
+		std::vector<unsigned char> lit;
+		std::vector<int> pending;
+		Vec3<float> packed[BVHPacket::capacity];
+		std::vector<std::vector<PathVertex> > bounces;
+
+		for (int i = 0; i < count; i++)
+			paths[i] = i;
+
+		for (int depth = 0; !queue.empty(); depth++) {
+
+			int n = queue.size();
+			countStat(depth == 0 ? STAT_PRIMARY_RAYS : STAT_REFLECTION_RAYS, n);
+			countDepth(depth, n);
+
+			hits.resize(n);
+			targets.resize(n);
+			for (int base = 0; base < n; base += BVHPacket::capacity) {
+
+				int m = std::min<int>(BVHPacket::capacity, n - base);
+				if (sources[base] == sources[base + m - 1]) {
+					castPacket(&queue[base], m, &hits[base]);
+					continue;
+				}
+				for (int i = base; i < base + m; i++)
+					castRay(queue[i], hits[i]);
+			}
+
+			for (int i = 0; i < n; i++)
+				targets[i] = hits[i].point;
+
+			// A hit on the far side of its own object is in that object's
+			// shadow, one test tells. The shadow rays that remain go as
+			// packets where they end on one object, else one by one.
+			lit.assign(n * lights.size(), 0);
+			for (int l = 0; l < lights.size(); l++) {
+
+				pending.clear();
+				unsigned long shadowed = 0;
+				for (int i = 0; i < n; i++) {
+					if (hits[i].object == -1)
+						continue;
+					if (blocks(hits[i], lights[l]->origin))
+						shadowed++;
+					else
+						pending.push_back(i);
+				}
+				countStat(STAT_SHADOW_RAYS, shadowed);
+
+				for (int base = 0; base < pending.size(); base += BVHPacket::capacity) {
+
+					int m = std::min<int>(BVHPacket::capacity, pending.size() - base);
+					bool coherent = true;
+					for (int i = 0; i < m; i++) {
+						packed[i] = targets[pending[base + i]];
+						coherent = coherent && hits[pending[base + i]].object == hits[pending[base]].object;
+					}
+
+					if (!coherent) {
+						for (int i = 0; i < m; i++)
+							lit[pending[base + i] * lights.size() + l] = !occluded(lights[l]->origin, packed[i]);
+						continue;
+					}
+
+					unsigned blocked = occludedPacket(lights[l]->origin, packed, m, (1u << m) - 1);
+					for (int i = 0; i < m; i++)
+						lit[pending[base + i] * lights.size() + l] = !((blocked >> i) & 1);
+				}
+			}
+
+			for (int i = 0; records && depth == 0 && i < n; i++)
+				record(hits[i], &lit[i * lights.size()], records[i]);
+
+			bounces.push_back(std::vector<PathVertex>());
+			std::vector<PathVertex> & vertices = bounces.back();
+			reflected.clear();
+			reflectedPaths.clear();
+			reflectedSources.clear();
+			reflectedThroughputs.clear();
+
+			for (int i = 0; i < n; i++) {
+
+				if (hits[i].object == -1)
+					continue;
+
+				const Hit & hit = hits[i];
+
+				PathVertex vertex;
+				vertex.path = paths[i];
+				shadeSurface(queue[i], hit, &lit[i * lights.size()], vertex.surface, vertex.light, vertex.mirror);
+				vertex.weight = vertex.mirror;
+
+				if (vertex.mirror != 0.0f) {
+
+					float next = throughputs[i] * vertex.mirror;
+					if (depth >= maxDepth) {
+						// never traced, sees the void
+					}
+					else if (!follow(hit, depth, vertex.weight, next)) {
+						// not traced, sees the void or with roulette nothing
+						if (roulette)
+							vertex.weight = 0.0f;
+					}
+					else {
+						reflected.push_back(reflect(queue[i], hit));
+						reflectedPaths.push_back(paths[i]);
+						reflectedSources.push_back(hit.object);
+						reflectedThroughputs.push_back(next);
+					}
+				}
+				vertices.push_back(vertex);
+			}
+
+			// the reflections off one object go together, they are cast as
+			// packets only where they all leave the same object
+			order.resize(reflected.size());
+			for (int i = 0; i < order.size(); i++)
+				order[i] = i;
+			std::stable_sort(order.begin(), order.end(), SourceOrder(reflectedSources));
+
+			queue.clear();
+			paths.resize(order.size());
+			sources.resize(order.size());
+			throughputs.resize(order.size());
+			for (int i = 0; i < order.size(); i++) {
+				queue.push_back(reflected[order[i]]);
+				paths[i] = reflectedPaths[order[i]];
+				sources[i] = reflectedSources[order[i]];
+				throughputs[i] = reflectedThroughputs[order[i]];
+			}
+		}
+
+		// a path that leaves the scene, or the depth limit, sees the void
+		for (int i = 0; i < count; i++)
+			colors[i] = voidColor;
+
+		for (int depth = bounces.size() - 1; depth >= 0; depth--) {
+			for (int v = 0; v < bounces[depth].size(); v++) {
 
-			surfaceColor = surf->getColor(inter) * (1 - mir) + mirrorColor * mir;
+				const PathVertex & vertex = bounces[depth][v];
+				Color & color = colors[vertex.path];
+
+				if (vertex.mirror != 0.0f)
+					color = (vertex.surface * (1 - vertex.mirror) + color * vertex.weight).intersect(vertex.light);
+				else
+					color = vertex.surface.intersect(vertex.light);
+			}
+		}
+	}
+
+	void record(const Hit & hit, const unsigned char * lit, ShadingRecord & entry) const {
+
+		entry.point = hit.point;
+		entry.normal = hit.normal;
+		entry.object = hit.object;
+		entry.lit = 0;
+		for (int l = 0; l < lights.size() && l < maxRecordLights; l++)
+			entry.lit |= (unsigned)lit[l] << l;
+	}
+
+	// Records keep the light visibility in one bit per light.
+	enum { maxRecordLights = 32 };
+	bool recordable() const { return lights.size() <= maxRecordLights; }
+
+	// Traces the shadow rays of the records again, after lights moved or
+	// objects changed. The rays toward each light go as one packet.
+	void updateVisibility(ShadingRecord * records, int count) const {
+
+		Vec3<float> targets[BVHPacket::capacity];
+
+		for (int base = 0; base < count; base += BVHPacket::capacity) {
+
+			int n = std::min<int>(BVHPacket::capacity, count - base);
+
+			unsigned mask = 0;
+			for (int i = 0; i < n; i++) {
+				if (records[base + i].object != -1)
+					mask |= 1u << i;
+				targets[i] = records[base + i].point;
+				records[base + i].lit = 0;
+			}
+
+			for (int l = 0; l < lights.size() && l < maxRecordLights; l++) {
+				unsigned blocked = occludedPacket(lights[l]->origin, targets, n, mask);
+				for (int i = 0; i < n; i++)
+					records[base + i].lit |= (unsigned)!((blocked >> i) & 1) << l;
+			}
+		}
+	}
+
+	// Shades a recorded hit as seen from origin. Only mirror reflections are
+	// traced, the visibility of the lights is taken from the record.
+	Color reshade(const Vec3<float> & origin, const ShadingRecord & record) const {
+
+		if (record.object == -1)
+			return voidColor;
+
+		Hit hit;
+		hit.object = record.object;
+		hit.point = record.point;
+		hit.normal = record.normal;
+
+		Ray ray(origin, record.point - origin);
+		hit.t = (record.point - origin).length();
+
+		unsigned char lit[maxRecordLights];
+		for (int l = 0; l < lights.size() && l < maxRecordLights; l++)
+			lit[l] = (record.lit >> l) & 1;
+
+		return shade(ray, hit, lit, 0);
+	}
+
+	// Whether the hit object alone blocks the shadow ray from origin to the
+	// hit, tested as in occluded(). Only one the light lies behind is tried,
+	// a mesh may block a light in front as well, occluded() finds that.
+	bool blocks(const Hit & hit, const Vec3<float> & origin) const {
+
+		if (hit.normal.dotProduct(origin - hit.point) >= 0.0f)
+			return false;
+
+		countStat(STAT_INTERSECTION_TESTS);
+		Vec3<float> dir = hit.point - origin;
+		Ray ray(origin, dir);
+		return AnyHit(this, ray).test(hit.object, dir.length() * (1.0f - maxLightError));
+	}
+
+	// castRay for up to BVHPacket::capacity rays traversing the BVH together.
+	void castPacket(const Ray * rays, int count, Hit * hits) const {
+
+		if (!built) {
+			for (int i = 0; i < count; i++)
+				castRay(rays[i], hits[i]);
+			return;
+		}
+
+		BVHPacket packet;
+		ClosestHit lanes[BVHPacket::capacity];
+
+		for (int i = 0; i < count; i++) {
+			lanes[i] = ClosestHit(this, rays[i]);
+			packet.add(rays[i].origin, rays[i].direction, std::numeric_limits<float>::infinity());
+			lanes[i].testUnbounded(packet.tMax[i]);
+		}
+		packet.finish(packet.all());
+
+		PacketClosestHit visit(lanes, packet);
+		bvh.traversePacket(packet, packet.all(), visit);
+
+		unsigned long tests = 0;
+		for (int i = 0; i < count; i++) {
+			fillHit(rays[i], lanes[i].index, lanes[i].part, packet.tMax[i], hits[i]);
+			tests += lanes[i].tests;
+		}
+		countStat(STAT_INTERSECTION_TESTS, tests);
+	}
+
+	// occluded() from one origin to the targets in mask, traced as a packet.
+	// Returns the lanes that are blocked.
+	unsigned occludedPacket(const Vec3<float> & origin, const Vec3<float> * targets, int count, unsigned mask) const {
+
+		if (!built) {
+			unsigned blocked = 0;
+			for (int i = 0; i < count; i++)
+				if (((mask >> i) & 1) && occluded(origin, targets[i]))
+					blocked |= 1u << i;
+			return blocked;
+		}
+
+		countStat(STAT_SHADOW_RAYS, __builtin_popcount(mask));
+
+		// the lanes point at their rays, which are built in place as Ray
+		// cannot be assigned
+		std::aligned_storage<sizeof(Ray), alignof(Ray)>::type rays[BVHPacket::capacity];
+
+		BVHPacket packet;
+		AnyHit lanes[BVHPacket::capacity];
+		unsigned blocked = 0;
+
+		for (int i = 0; i < count; i++) {
+
+			Vec3<float> dir = targets[i] - origin;
+			const Ray * ray = new (&rays[i]) Ray(origin, dir);
+			packet.add(origin, ray->direction, dir.length() * (1.0f - maxLightError));
+			lanes[i] = AnyHit(this, *ray);
+
+			if (((mask >> i) & 1) && lanes[i].testUnbounded(packet.tMax[i]))
+				blocked |= 1u << i;
+		}
+		packet.finish(mask & ~blocked);
+
+		PacketAnyHit visit(lanes, packet);
+		bvh.traversePacket(packet, mask & ~blocked, visit);
+
+		unsigned long tests = 0;
+		for (int i = 0; i < count; i++) {
+			if (lanes[i].found)
+				blocked |= 1u << i;
+			tests += lanes[i].tests;
+		}
+		countStat(STAT_INTERSECTION_TESTS, tests);
+		return blocked & mask;
+	}
+
+	int closestObject(const Ray & ray, float & tMax, int & part) const {
+
+		ClosestHit closest(this, ray);
+
+		if (!built) {
+			for (int i = 0; i < store.size(); i++)
+				closest.test(i, tMax);
 		}
 		else {
-			surfaceColor = surf->getColor(inter);
+			closest.testUnbounded(tMax);
+			bvh.traverse(BVHRay(ray.origin, ray.direction), tMax, closest);
 		}
 
-		return surfaceColor.intersect(lightColor);
+		countStat(STAT_INTERSECTION_TESTS, closest.tests);
+		part = closest.part;
+		return closest.index;
 	}
 
-	int castRay(const Ray & ray) const {
+	// Tells whether anything lies between origin and target. The last
+	// maxLightError fraction of the segment is ignored so the surface the
+	// target lies on does not shadow itself.
+	bool occluded(const Vec3<float> & origin, const Vec3<float> & target) const {
+
+		countStat(STAT_SHADOW_RAYS);
+		Vec3<float> dir = target - origin;
+		Ray ray(origin, dir);
+		float tMax = dir.length() * (1.0f - maxLightError);
+
+		AnyHit any(this, ray);
+
+		if (!built) {
+			for (int i = 0; i < store.size() && !any.found; i++)
+				any.found = any.test(i, tMax);
+		}
+		else if (!any.testUnbounded(tMax)) {
+			bvh.traverse(BVHRay(ray.origin, ray.direction), tMax, any);
+		}
+
+		countStat(STAT_INTERSECTION_TESTS, any.tests);
+		return any.found;
+	}
+
+	int castRayLinear(const Ray & ray) const {
 
 		int index = -1;
 		float smallestDist;
 		float tmpDist;
 
-		for (int i = 0; i < objects.size(); i++) {
+		SimdRay r(ray.origin, ray.direction);
+		for (int i = 0; i < store.size(); i++) {
 			
-			tmpDist = objects[i]->distance(ray);
+			tmpDist = distance(i, ray, r);
 			if (tmpDist > 0.0f) {
 				if (tmpDist > minCastDist && (index == -1 || tmpDist < smallestDist)) {
 					smallestDist = tmpDist;
@@ -250,11 +1618,32 @@ public:
 	void updateRotation(const float diffHor, const float diffVer) {
 		setRotation(rotHor + diffHor, rotVer + diffVer);
 	}
+	// Whether both cameras see the same image.
+	bool sameView(const Camera * other) const {
+		return w == other->w && h == other->h && rotHor == other->rotHor && rotVer == other->rotVer
+			&& origin.getX() == other->origin.getX() && origin.getY() == other->origin.getY() 
+			&& origin.getZ() == other->origin.getZ();
+	}
 	void setRotHorizontal(const float _rotHor) { rotHor = _rotHor; }
 	void setRotVertival(const float _rotVer) { rotVer = _rotVer; }
 
+	virtual Camera * clone() const = 0;
 	virtual void resize(int _w, int _h) = 0;
 	virtual Ray getRay(int _w, int _h) const = 0;
+
+	// Pixel whose ray passes closest to point and the distance of point
+	// along the view axis. False if the point is behind the camera, outside
+	// the image or the camera cannot tell.
+	virtual bool project(const Vec3<float> & point, int & x, int & y, float & depth) const { return false; }
+
+	// Rays of a block of width x height pixels spaced step apart, row by row.
+	virtual void getRays(int left, int bottom, int width, int height, int step, std::vector<Ray> & rays) const {
+
+		rays.clear();
+		for (int j = 0; j < height; j++)
+			for (int i = 0; i < width; i++)
+				rays.push_back(getRay(left + i * step, bottom + j * step));
+	}
 };
 
 class Cam_Std : public Camera
@@ -271,6 +1660,13 @@ public:
 		resize(w, h);
 	}
 
+	virtual Camera * clone() const {
+
+		return new Cam_Std(*this);
+	}
+
+	float getViewPort() const { return viewPort; }
+
 	virtual void resize(int _w, int _h) {
 
 		w = _w;
@@ -287,6 +1683,20 @@ public:
 
 		return Ray(origin, rotation * direction);
 	}
+
+	// The inverse of getRay, the rotation is orthonormal so its transpose
+	// takes the point into camera space.
+	virtual bool project(const Vec3<float> & point, int & x, int & y, float & depth) const {
+
+		Vec3<float> relative = point - origin;
+		depth = rotation.getZ().dotProduct(relative);
+		if (depth <= 0.0f)
+			return false;
+
+		x = (int)floor(rotation.getX().dotProduct(relative) / (depth * pixelSize) + 0.5f) + w / 2;
+		y = (int)floor(rotation.getY().dotProduct(relative) / (depth * pixelSize) + 0.5f) + h / 2;
+		return x >= 0 && x < w && y >= 0 && y < h;
+	}
 };
 
 #endif
\ No newline at end of file